@@ -9,10 +9,17 @@ expr
         | (ADD | SUB) expr  # UnaryOp
         | expr (MUL | DIV) expr  # BinaryOp
         | expr (ADD | SUB) expr  # BinaryOp
+        | FUNCTION '(' argument (',' argument)* ')'  # FunctionCall
         | CELL  # Cell
         | NUMBER  # Literal
         ;
 
+// a range is not a value and can only be passed to a function
+argument
+        : CELL ':' CELL  # Range
+        | expr  # Expression
+        ;
+
 // number literals cannot be signed, or else 1-2 would be lexed as [1] [-2]
 fragment INT: [-+]? UINT ;
 fragment UINT: [0-9]+ ;
@@ -27,4 +34,6 @@ SUB: '-' ;
 MUL: '*' ;
 DIV: '/' ;
 CELL: [A-Z]+[0-9]+ ;
+// a function name is lexed as CELL if followed by digits
+FUNCTION: [A-Z]+ ;
 WS: [ \t\n\r]+ -> skip ;
\ No newline at end of file
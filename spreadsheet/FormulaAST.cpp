@@ -4,11 +4,20 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstddef>
+#include <functional>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <memory_resource>
 #include <optional>
 #include <sstream>
+#include <string_view>
 
 namespace ASTImpl {
 
@@ -67,34 +76,66 @@ constexpr PrecedenceRule PRECEDENCE_RULES[EP_END][EP_END] = {
     /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
 };
 
+// The nodes of an expression tree live in the ExprArena of the parser that
+// built them and are never deleted one by one: the arena releases all of
+// them at once. Node classes must therefore not own any other memory.
 class Expr {
 public:
-    virtual ~Expr() = default;
-    virtual void Print(std::ostream& out) const = 0;
-    virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-    virtual double Evaluate(const SheetInterface& sheet) const = 0;
+    // Appends the instructions computing this expression to the program
+    virtual void Compile(std::vector<Instruction>& program) const = 0;
+
+    // Appends the instructions adding this expression, as an argument, to
+    // the aggregate being computed
+    virtual void CompileArgument(std::vector<Instruction>& program, Instruction::Function function) const {
+        Compile(program);
+        Instruction instruction{};
+        instruction.code = Instruction::AggregateValue;
+        instruction.function = function;
+        program.push_back(instruction);
+    }
 
-    // higher is tighter
-    virtual ExprPrecedence GetPrecedence() const = 0;
+protected:
+    ~Expr() = default;
+};
 
-    void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
-                      bool right_child = false) const {
-        auto precedence = GetPrecedence();
-        auto mask = right_child ? PR_RIGHT : PR_LEFT;
-        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
-        if (parens_needed) {
-            out << '(';
-        }
+namespace {
+// A monotonic allocator for the nodes of one expression tree. The first
+// block is part of the arena itself, so the tree of a typical formula takes
+// no heap allocation at all, and the nodes of larger trees are still packed
+// into a few contiguous blocks instead of being scattered over the heap.
+class ExprArena {
+public:
+    ExprArena()
+        : resource_(initial_block_, sizeof(initial_block_)) {
+    }
 
-        DoPrintFormula(out, precedence);
+    ExprArena(const ExprArena&) = delete;
+    ExprArena& operator=(const ExprArena&) = delete;
 
-        if (parens_needed) {
-            out << ')';
-        }
+    template <typename T, typename... Args>
+    const Expr* Make(Args&&... args) {
+        return new (resource_.allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    // Copies the nodes [first, last) into an array owned by the arena
+    const Expr* const* MakeArray(const Expr* const* first, const Expr* const* last) {
+        size_t count = last - first;
+        auto* result = static_cast<const Expr**>(resource_.allocate(count * sizeof(const Expr*), alignof(const Expr*)));
+        std::copy(first, last, result);
+        return result;
+    }
+
+    std::pmr::memory_resource* GetResource() {
+        return &resource_;
     }
+
+private:
+    static constexpr size_t INITIAL_BLOCK_SIZE = 4096;
+
+    alignas(std::max_align_t) std::byte initial_block_[INITIAL_BLOCK_SIZE];
+    std::pmr::monotonic_buffer_resource resource_;
 };
 
-namespace {
 class BinaryOpExpr final : public Expr {
 public:
     enum Type : char {
@@ -105,72 +146,37 @@ public:
     };
 
 public:
-    explicit BinaryOpExpr(Type type, std::unique_ptr<Expr> lhs, std::unique_ptr<Expr> rhs)
+    explicit BinaryOpExpr(Type type, const Expr* lhs, const Expr* rhs)
         : type_(type)
-        , lhs_(std::move(lhs))
-        , rhs_(std::move(rhs)) {
+        , lhs_(lhs)
+        , rhs_(rhs) {
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        lhs_->Print(out);
-        out << ' ';
-        rhs_->Print(out);
-        out << ')';
-    }
-
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        lhs_->PrintFormula(out, precedence);
-        out << static_cast<char>(type_);
-        rhs_->PrintFormula(out, precedence, /* right_child = */ true);
-    }
-
-    ExprPrecedence GetPrecedence() const override {
+    void Compile(std::vector<Instruction>& program) const override {
+        lhs_->Compile(program);
+        rhs_->Compile(program);
+        Instruction instruction{};
         switch (type_) {
             case Add:
-                return EP_ADD;
+                instruction.code = Instruction::Add;
+                break;
             case Subtract:
-                return EP_SUB;
+                instruction.code = Instruction::Subtract;
+                break;
             case Multiply:
-                return EP_MUL;
+                instruction.code = Instruction::Multiply;
+                break;
             case Divide:
-                return EP_DIV;
-            default:
-                // have to do this because VC++ has a buggy warning
-                assert(false);
-                return static_cast<ExprPrecedence>(INT_MAX);
-        }
-    }
-
-    double Evaluate(const SheetInterface& sheet) const override {
-        double lhs = lhs_->Evaluate(sheet);
-        double rhs = rhs_->Evaluate(sheet);
-        double result = 0.0;
-        switch (type_) 
-        {
-        case Add:
-            result = lhs + rhs;
-            break;
-        case Subtract:
-            result = lhs - rhs;
-            break;
-        case Multiply:
-            result = lhs * rhs;
-            break;
-        case Divide:
-            result = lhs / rhs;
-        }
-
-        if (std::isfinite(result)) {
-            return result; 
+                instruction.code = Instruction::Divide;
+                break;
         }
-        throw FormulaError(FormulaError::Category::Div0);
+        program.push_back(instruction);
     }
 
 private:
     Type type_;
-    std::unique_ptr<Expr> lhs_;
-    std::unique_ptr<Expr> rhs_;
+    const Expr* lhs_;
+    const Expr* rhs_;
 };
 
 class UnaryOpExpr final : public Expr {
@@ -181,138 +187,933 @@ public:
     };
 
 public:
-    explicit UnaryOpExpr(Type type, std::unique_ptr<Expr> operand)
+    explicit UnaryOpExpr(Type type, const Expr* operand)
         : type_(type)
-        , operand_(std::move(operand)) {
+        , operand_(operand) {
     }
 
-    void Print(std::ostream& out) const override {
-        out << '(' << static_cast<char>(type_) << ' ';
-        operand_->Print(out);
-        out << ')';
+    void Compile(std::vector<Instruction>& program) const override {
+        operand_->Compile(program);
+        Instruction instruction{};
+        instruction.code = type_ == UnaryMinus ? Instruction::UnaryMinus : Instruction::UnaryPlus;
+        program.push_back(instruction);
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-        out << static_cast<char>(type_);
-        operand_->PrintFormula(out, precedence);
+private:
+    Type type_;
+    const Expr* operand_;
+};
+
+class CellExpr final : public Expr {
+public:
+    explicit CellExpr(Position cell)
+        : cell_pos_(cell) {
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_UNARY;
+    void Compile(std::vector<Instruction>& program) const override {
+        Instruction instruction{};
+        instruction.code = Instruction::Cell;
+        instruction.operand.cell = {cell_pos_.row, cell_pos_.col};
+        program.push_back(instruction);
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        double result = operand_.get()->Evaluate(sheet);
-        return type_ == UnaryMinus ? (-1) * result : result;
+    void CompileArgument(std::vector<Instruction>& program, Instruction::Function function) const override {
+        Instruction instruction{};
+        instruction.code = Instruction::AggregateCell;
+        instruction.function = function;
+        instruction.operand.cell = {cell_pos_.row, cell_pos_.col};
+        program.push_back(instruction);
     }
 
 private:
-    Type type_;
-    std::unique_ptr<Expr> operand_;
+    Position cell_pos_;
 };
 
-class CellExpr final : public Expr {
+class NumberExpr final : public Expr {
 public:
-    explicit CellExpr(const Position* cell)
-        : cell_pos_(cell) 
-    {}
-    
-    void Print(std::ostream& out) const override {
-        if (!cell_pos_->IsValid()) {
-            out << FormulaError::Category::Ref;
-        } else {
-            out << cell_pos_->ToString();
-        }
+    explicit NumberExpr(double value)
+        : value_(value) {
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        Print(out);
+    void Compile(std::vector<Instruction>& program) const override {
+        Instruction instruction{};
+        instruction.code = Instruction::Number;
+        instruction.operand.number = value_;
+        program.push_back(instruction);
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+private:
+    double value_;
+};
+
+// A range is not a value and may only be an argument of a function
+class RangeExpr final : public Expr {
+public:
+    explicit RangeExpr(CellRange range)
+        : range_(range) {
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        if (!cell_pos_->IsValid()) {
-            throw FormulaError(FormulaError::Category::Ref);
-        }
-        if (!(sheet.GetCell(*cell_pos_))) {
-            return 0.0;
+    void Compile(std::vector<Instruction>& /* program */) const override {
+        assert(false);
+    }
+
+    void CompileArgument(std::vector<Instruction>& program, Instruction::Function function) const override {
+        Instruction instruction{};
+        instruction.code = Instruction::AggregateRange;
+        instruction.function = function;
+        instruction.operand.range = {
+            static_cast<int16_t>(range_.first.row),
+            static_cast<int16_t>(range_.first.col),
+            static_cast<int16_t>(range_.last.row),
+            static_cast<int16_t>(range_.last.col),
+        };
+        program.push_back(instruction);
+    }
+
+private:
+    CellRange range_;
+};
+
+class FunctionExpr final : public Expr {
+public:
+    // args points to arg_count nodes in an array owned by the arena
+    FunctionExpr(Instruction::Function function, const Expr* const* args, size_t arg_count)
+        : function_(function)
+        , args_(args)
+        , arg_count_(arg_count) {
+    }
+
+    void Compile(std::vector<Instruction>& program) const override {
+        Instruction instruction{};
+        instruction.code = Instruction::AggregateBegin;
+        instruction.function = function_;
+        program.push_back(instruction);
+        for (size_t i = 0; i < arg_count_; ++i) {
+            args_[i]->CompileArgument(program, function_);
         }
+        instruction.code = Instruction::AggregateEnd;
+        program.push_back(instruction);
+    }
+
+private:
+    Instruction::Function function_;
+    const Expr* const* args_;
+    size_t arg_count_;
+};
+
+struct FunctionName {
+    std::string_view name;
+    Instruction::Function function;
+};
 
-        CellInterface::Value value = sheet.GetCell(*cell_pos_)->GetValue();
+constexpr FunctionName FUNCTION_NAMES[] = {
+    {"SUM", Instruction::Sum},
+    {"AVERAGE", Instruction::Average},
+    {"MIN", Instruction::Min},
+    {"MAX", Instruction::Max},
+    {"COUNT", Instruction::Count},
+};
 
-        if (std::holds_alternative<double>(value)) {
-            return std::get<double>(value);
+Instruction::Function FindFunction(std::string_view name) {
+    for (const auto& entry : FUNCTION_NAMES) {
+        if (entry.name == name) {
+            return entry.function;
         }
+    }
+    throw FormulaException("Unknown function: " + std::string(name));
+}
+
+std::string_view GetFunctionName(Instruction::Function function) {
+    for (const auto& entry : FUNCTION_NAMES) {
+        if (entry.function == function) {
+            return entry.name;
+        }
+    }
+    assert(false);
+    return {};
+}
+
+// Makes a range from the texts of its corners, whichever two opposite
+// corners they are
+CellRange MakeRange(std::string_view first_str, std::string_view last_str) {
+    auto first = Position::FromString(first_str);
+    if (!first.IsValid()) {
+        throw FormulaException("Invalid position: " + std::string(first_str));
+    }
+    auto last = Position::FromString(last_str);
+    if (!last.IsValid()) {
+        throw FormulaException("Invalid position: " + std::string(last_str));
+    }
+    return {{std::min(first.row, last.row), std::min(first.col, last.col)},
+            {std::max(first.row, last.row), std::max(first.col, last.col)}};
+}
 
-        if (std::holds_alternative<std::string>(value)) {
-            std::string str = std::get<std::string>(value);
-            if (str.empty()) {
-                return 0;
-            } 
-            try {
-                double tmp = std::stod(str);
-                return tmp;
+// How many values the instruction adds to the stack
+int GetStackEffect(const Instruction& instruction) {
+    switch (instruction.code) {
+        case Instruction::Number:
+        case Instruction::Cell:
+            return 1;
+        case Instruction::UnaryPlus:
+        case Instruction::UnaryMinus:
+        case Instruction::AggregateRange:
+        case Instruction::AggregateCell:
+            return 0;
+        case Instruction::AggregateBegin:
+            return 2;
+        default:
+            return -1;
+    }
+}
+
+// Checks that the program is one the compiler could have produced and
+// returns the maximal depth of its stack
+size_t CheckProgram(const std::vector<Instruction>& program) {
+    auto fail = [](const char* what) {
+        throw FormulaException(std::string("Invalid formula program: ") + what);
+    };
+    // Stack depth right after each unfinished AggregateBegin
+    std::vector<std::pair<Instruction::Function, size_t>> aggregates;
+    size_t depth = 0;
+    size_t max_depth = 0;
+    // Offsets from an anchor are within the sheet size as well
+    auto check_cell = [&fail](Instruction::CellRef cell) {
+        if (cell.row <= -Position::MAX_ROWS || cell.row >= Position::MAX_ROWS || cell.col <= -Position::MAX_COLS
+            || cell.col >= Position::MAX_COLS) {
+            fail("cell reference out of bounds");
+        }
+    };
+    for (const Instruction& instruction : program) {
+        size_t base = aggregates.empty() ? 0 : aggregates.back().second;
+        size_t arguments = 0;
+        switch (instruction.code) {
+            case Instruction::Number:
+                if (!std::isfinite(instruction.operand.number)) {
+                    fail("number is not finite");
+                }
+                break;
+            case Instruction::Cell:
+                check_cell(instruction.operand.cell);
+                break;
+            case Instruction::Add:
+            case Instruction::Subtract:
+            case Instruction::Multiply:
+            case Instruction::Divide:
+                arguments = 2;
+                break;
+            case Instruction::UnaryPlus:
+            case Instruction::UnaryMinus:
+                arguments = 1;
+                break;
+            case Instruction::AggregateBegin:
+                if (instruction.function > Instruction::Count) {
+                    fail("unknown function");
+                }
+                aggregates.emplace_back(instruction.function, depth + 2);
+                break;
+            case Instruction::AggregateCell:
+                check_cell(instruction.operand.cell);
+                [[fallthrough]];
+            case Instruction::AggregateValue:
+            case Instruction::AggregateRange:
+            case Instruction::AggregateEnd: {
+                size_t expected = instruction.code == Instruction::AggregateValue ? base + 1 : base;
+                if (aggregates.empty() || aggregates.back().first != instruction.function || depth != expected) {
+                    fail("misplaced aggregate instruction");
+                }
+                if (instruction.code == Instruction::AggregateEnd) {
+                    aggregates.pop_back();
+                }
+                break;
             }
-            catch (const std::invalid_argument& exc) {
-                throw FormulaError(FormulaError::Category::Value);
+            default:
+                fail("unknown instruction");
+        }
+        if (depth < base + arguments) {
+            fail("stack underflow");
+        }
+        depth += GetStackEffect(instruction);
+        max_depth = std::max(max_depth, depth);
+    }
+    if (depth != 1 || !aggregates.empty()) {
+        fail("the result is not a single value");
+    }
+    return max_depth;
+}
+
+ExprPrecedence GetPrecedence(const Instruction& instruction) {
+    switch (instruction.code) {
+        case Instruction::Add:
+            return EP_ADD;
+        case Instruction::Subtract:
+            return EP_SUB;
+        case Instruction::Multiply:
+            return EP_MUL;
+        case Instruction::Divide:
+            return EP_DIV;
+        case Instruction::UnaryPlus:
+        case Instruction::UnaryMinus:
+            return EP_UNARY;
+        default:
+            return EP_ATOM;
+    }
+}
+
+char GetOperatorSign(const Instruction& instruction) {
+    switch (instruction.code) {
+        case Instruction::Add:
+        case Instruction::UnaryPlus:
+            return '+';
+        case Instruction::Subtract:
+        case Instruction::UnaryMinus:
+            return '-';
+        case Instruction::Multiply:
+            return '*';
+        case Instruction::Divide:
+            return '/';
+        default:
+            assert(false);
+            return '?';
+    }
+}
+
+// Prints a program back as an expression. The program is in postfix order,
+// so the subexpression computed by the instruction at index i ends at i and
+// starts at starts_[i]; the right operand of a binary operation ends just
+// before the operation, and the left operand ends just before the right one.
+// Likewise, the arguments of an aggregate call end with AggregateValue,
+// AggregateRange or AggregateCell and follow one another back to
+// AggregateBegin.
+class ProgramPrinter {
+public:
+    ProgramPrinter(const std::vector<Instruction>& program, Position anchor)
+        : program_(program)
+        , anchor_(anchor)
+        , starts_(program.size()) {
+        for (size_t i = 0; i < program_.size(); ++i) {
+            switch (program_[i].code) {
+                case Instruction::Number:
+                case Instruction::Cell:
+                case Instruction::AggregateBegin:
+                case Instruction::AggregateRange:
+                case Instruction::AggregateCell:
+                    starts_[i] = i;
+                    break;
+                case Instruction::UnaryPlus:
+                case Instruction::UnaryMinus:
+                case Instruction::AggregateValue:
+                    starts_[i] = starts_[i - 1];
+                    break;
+                case Instruction::AggregateEnd: {
+                    size_t start = i - 1;
+                    while (program_[start].code != Instruction::AggregateBegin) {
+                        start = starts_[start] - 1;
+                    }
+                    starts_[i] = start;
+                    break;
+                }
+                default:
+                    starts_[i] = starts_[starts_[i - 1] - 1];
             }
         }
+    }
+
+    void Print(std::ostream& out) const {
+        Print(out, program_.size() - 1);
+    }
 
-        throw std::get<FormulaError>(value);
+    void PrintFormula(std::ostream& out) const {
+        PrintFormula(out, program_.size() - 1, EP_ATOM);
     }
 
 private:
-    const Position* cell_pos_;
+    const std::vector<Instruction>& program_;
+    Position anchor_;
+    std::vector<size_t> starts_;
+
+    void Print(std::ostream& out, size_t end) const {
+        const Instruction& instruction = program_[end];
+        switch (instruction.code) {
+            case Instruction::Number:
+            case Instruction::Cell:
+                PrintAtom(out, instruction);
+                break;
+            case Instruction::UnaryPlus:
+            case Instruction::UnaryMinus:
+                out << '(' << GetOperatorSign(instruction) << ' ';
+                Print(out, end - 1);
+                out << ')';
+                break;
+            case Instruction::AggregateEnd:
+                out << '(' << GetFunctionName(instruction.function);
+                for (size_t arg_end : GetArguments(end)) {
+                    out << ' ';
+                    if (program_[arg_end].code == Instruction::AggregateRange) {
+                        PrintRange(out, program_[arg_end]);
+                    } else if (program_[arg_end].code == Instruction::AggregateCell) {
+                        PrintAtom(out, program_[arg_end]);
+                    } else {
+                        Print(out, arg_end - 1);
+                    }
+                }
+                out << ')';
+                break;
+            default:
+                out << '(' << GetOperatorSign(instruction) << ' ';
+                Print(out, starts_[end - 1] - 1);
+                out << ' ';
+                Print(out, end - 1);
+                out << ')';
+        }
+    }
+
+    void PrintFormula(std::ostream& out, size_t end, ExprPrecedence parent_precedence,
+                      bool right_child = false) const {
+        const Instruction& instruction = program_[end];
+        auto precedence = GetPrecedence(instruction);
+        auto mask = right_child ? PR_RIGHT : PR_LEFT;
+        bool parens_needed = PRECEDENCE_RULES[parent_precedence][precedence] & mask;
+        if (parens_needed) {
+            out << '(';
+        }
+
+        switch (instruction.code) {
+            case Instruction::Number:
+            case Instruction::Cell:
+                PrintAtom(out, instruction);
+                break;
+            case Instruction::UnaryPlus:
+            case Instruction::UnaryMinus:
+                out << GetOperatorSign(instruction);
+                PrintFormula(out, end - 1, precedence);
+                break;
+            case Instruction::AggregateEnd: {
+                out << GetFunctionName(instruction.function) << '(';
+                bool first = true;
+                for (size_t arg_end : GetArguments(end)) {
+                    if (!first) {
+                        out << ',';
+                    }
+                    first = false;
+                    if (program_[arg_end].code == Instruction::AggregateRange) {
+                        PrintRange(out, program_[arg_end]);
+                    } else if (program_[arg_end].code == Instruction::AggregateCell) {
+                        PrintAtom(out, program_[arg_end]);
+                    } else {
+                        PrintFormula(out, arg_end - 1, EP_ATOM);
+                    }
+                }
+                out << ')';
+                break;
+            }
+            default:
+                PrintFormula(out, starts_[end - 1] - 1, precedence);
+                out << GetOperatorSign(instruction);
+                PrintFormula(out, end - 1, precedence, /* right_child = */ true);
+        }
+
+        if (parens_needed) {
+            out << ')';
+        }
+    }
+
+    // Returns the last instructions of the arguments of the aggregate call
+    // ending at end, in the order of the arguments
+    std::vector<size_t> GetArguments(size_t end) const {
+        std::vector<size_t> arg_ends;
+        for (size_t arg_end = end - 1; arg_end != starts_[end]; arg_end = starts_[arg_end] - 1) {
+            arg_ends.push_back(arg_end);
+        }
+        std::reverse(arg_ends.begin(), arg_ends.end());
+        return arg_ends;
+    }
+
+    void PrintAtom(std::ostream& out, const Instruction& instruction) const {
+        if (instruction.code == Instruction::Number) {
+            out << instruction.operand.number;
+            return;
+        }
+        PrintPosition(out, {anchor_.row + instruction.operand.cell.row,
+                            anchor_.col + instruction.operand.cell.col});
+    }
+
+    void PrintRange(std::ostream& out, const Instruction& instruction) const {
+        const auto& range = instruction.operand.range;
+        PrintPosition(out, {anchor_.row + range.first_row, anchor_.col + range.first_col});
+        out << ':';
+        PrintPosition(out, {anchor_.row + range.last_row, anchor_.col + range.last_col});
+    }
+
+    static void PrintPosition(std::ostream& out, Position pos) {
+        if (!pos.IsValid()) {
+            out << FormulaError(FormulaError::Category::Ref);
+        } else {
+            char buffer[Position::MAX_STRING_LENGTH];
+            out.write(buffer, pos.ToChars(buffer) - buffer);
+        }
+    }
 };
 
-class NumberExpr final : public Expr {
+FormulaAST::Value GetCellValue(const SheetInterface& sheet, Position anchor, Instruction::CellRef cell) {
+    Position pos{anchor.row + cell.row, anchor.col + cell.col};
+    if (!pos.IsValid()) {
+        return FormulaError(FormulaError::Category::Ref);
+    }
+    const CellInterface* cell_ptr = sheet.GetCell(pos);
+    if (!cell_ptr) {
+        return 0.0;
+    }
+    return cell_ptr->GetNumericValue();
+}
+
+// The kernels keep several independent partial results, so that the compiler
+// can put the loop on SIMD registers: a single running sum or minimum would
+// force it to process the values one by one
+constexpr size_t KERNEL_LANES = 4;
+
+double SumKernel(const double* values, size_t count) {
+    double lanes[KERNEL_LANES] = {};
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        for (size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+            lanes[lane] += values[i + lane];
+        }
+    }
+    double sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    for (; i < count; ++i) {
+        sum += values[i];
+    }
+    return sum;
+}
+
+template <typename Less>
+double ExtremumKernel(const double* values, size_t count, double init, Less less) {
+    double lanes[KERNEL_LANES] = {init, init, init, init};
+    size_t i = 0;
+    for (; i + KERNEL_LANES <= count; i += KERNEL_LANES) {
+        for (size_t lane = 0; lane < KERNEL_LANES; ++lane) {
+            lanes[lane] = less(values[i + lane], lanes[lane]) ? values[i + lane] : lanes[lane];
+        }
+    }
+    double result = init;
+    for (double lane : lanes) {
+        result = less(lane, result) ? lane : result;
+    }
+    for (; i < count; ++i) {
+        result = less(values[i], result) ? values[i] : result;
+    }
+    return result;
+}
+
+// The state of an aggregate is two stack slots: the accumulated value and
+// the count of numbers seen so far
+double GetAggregateInitialValue(Instruction::Function function) {
+    switch (function) {
+        case Instruction::Min:
+            return std::numeric_limits<double>::infinity();
+        case Instruction::Max:
+            return -std::numeric_limits<double>::infinity();
+        default:
+            return 0.0;
+    }
+}
+
+void Aggregate(Instruction::Function function, double* state, const double* values, size_t count) {
+    switch (function) {
+        case Instruction::Sum:
+        case Instruction::Average:
+            state[0] += SumKernel(values, count);
+            break;
+        case Instruction::Min:
+            state[0] = ExtremumKernel(values, count, state[0], std::less<double>());
+            break;
+        case Instruction::Max:
+            state[0] = ExtremumKernel(values, count, state[0], std::greater<double>());
+            break;
+        case Instruction::Count:
+            break;
+    }
+    state[1] += static_cast<double>(count);
+}
+
+// The result may be non-finite: an overflown sum, or AVERAGE of no numbers
+// which is 0/0, and then the formula evaluates to #DIV/0!
+double GetAggregateResult(Instruction::Function function, const double* state) {
+    switch (function) {
+        case Instruction::Sum:
+            return state[0];
+        case Instruction::Average:
+            return state[0] / state[1];
+        case Instruction::Count:
+            return state[1];
+        default:
+            // MIN and MAX of no numbers are zero
+            return state[1] == 0 ? 0.0 : state[0];
+    }
+}
+
+// Splits a formula into the tokens of the Formula.g4 grammar. It reads the
+// input in place and throws FormulaException on a character that cannot
+// start a token.
+class Tokenizer {
 public:
-    explicit NumberExpr(double value)
-        : value_(value) {
+    enum TokenKind {
+        End,
+        Number,
+        Cell,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        LeftParen,
+        RightParen,
+        Colon,
+        Comma,
+        Function,
+    };
+
+    struct Token {
+        TokenKind kind = End;
+        std::string_view text;
+    };
+
+    explicit Tokenizer(std::string_view input)
+        : input_(input) {
+        Advance();
     }
 
-    void Print(std::ostream& out) const override {
-        out << value_;
+    const Token& Current() const {
+        return token_;
     }
 
-    void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-        out << value_;
+    Token Peek() const {
+        Tokenizer next = *this;
+        next.Advance();
+        return next.token_;
     }
 
-    ExprPrecedence GetPrecedence() const override {
-        return EP_ATOM;
+    void Advance() {
+        while (offset_ < input_.size()) {
+            char c = input_[offset_];
+            if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+                break;
+            }
+            ++offset_;
+        }
+        if (offset_ == input_.size()) {
+            token_ = {End, {}};
+            return;
+        }
+
+        size_t begin = offset_;
+        size_t end = begin + 1;
+        TokenKind kind;
+        switch (input_[begin]) {
+            case '+':
+                kind = Add;
+                break;
+            case '-':
+                kind = Sub;
+                break;
+            case '*':
+                kind = Mul;
+                break;
+            case '/':
+                kind = Div;
+                break;
+            case '(':
+                kind = LeftParen;
+                break;
+            case ')':
+                kind = RightParen;
+                break;
+            case ':':
+                kind = Colon;
+                break;
+            case ',':
+                kind = Comma;
+                break;
+            default:
+                if (IsUpper(input_[begin])) {
+                    // CELL: [A-Z]+[0-9]+, otherwise FUNCTION: [A-Z]+
+                    while (end < input_.size() && IsUpper(input_[end])) {
+                        ++end;
+                    }
+                    if (DigitAt(end)) {
+                        end = SkipDigits(end);
+                        kind = Cell;
+                    } else {
+                        kind = Function;
+                    }
+                } else {
+                    // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+                    end = SkipDigits(begin);
+                    if (end < input_.size() && input_[end] == '.' && DigitAt(end + 1)) {
+                        end = SkipDigits(end + 1);
+                    }
+                    if (end == begin) {
+                        Fail();
+                    }
+                    if (end < input_.size() && (input_[end] == 'e' || input_[end] == 'E')) {
+                        size_t exponent = end + 1;
+                        if (exponent < input_.size() && (input_[exponent] == '+' || input_[exponent] == '-')) {
+                            ++exponent;
+                        }
+                        if (DigitAt(exponent)) {
+                            end = SkipDigits(exponent);
+                        }
+                    }
+                    kind = Number;
+                }
+        }
+        token_ = {kind, input_.substr(begin, end - begin)};
+        offset_ = end;
     }
 
-    double Evaluate(const SheetInterface& sheet) const override {
-        return value_;
+    [[noreturn]] static void Fail() {
+        throw FormulaException("Formula exception");
     }
 
 private:
-    double value_;
+    std::string_view input_;
+    size_t offset_ = 0;
+    Token token_;
+
+    static bool IsDigit(char c) {
+        return c >= '0' && c <= '9';
+    }
+
+    static bool IsUpper(char c) {
+        return c >= 'A' && c <= 'Z';
+    }
+
+    bool DigitAt(size_t offset) const {
+        return offset < input_.size() && IsDigit(input_[offset]);
+    }
+
+    size_t SkipDigits(size_t offset) const {
+        while (DigitAt(offset)) {
+            ++offset;
+        }
+        return offset;
+    }
 };
 
-class ParseASTListener final : public FormulaBaseListener {
+// Hand-written parser for the Formula.g4 grammar. It works on the tokens
+// directly, without building a parse tree, and produces the same AST as the
+// ANTLR pipeline: binary operators are parsed by precedence climbing and are
+// left-associative, and a unary operator applies only to the primary
+// expression right after it, exactly as in the generated parser.
+class FastParser {
 public:
-    std::unique_ptr<Expr> MoveRoot() {
-        assert(args_.size() == 1);
-        auto root = std::move(args_.front());
-        args_.clear();
+    explicit FastParser(std::string_view input)
+        : tokens_(input) {
+    }
+
+    FormulaAST Parse() {
+        auto root = ParseExpression(PREC_ADDITIVE);
+        if (tokens_.Current().kind != Tokenizer::End) {
+            Tokenizer::Fail();
+        }
+        return FormulaAST(*root, {cells_.begin(), cells_.end()}, {ranges_.begin(), ranges_.end()});
+    }
+
+private:
+    enum BinaryPrecedence {
+        PREC_NONE,
+        PREC_ADDITIVE,
+        PREC_MULTIPLICATIVE,
+    };
+
+    Tokenizer tokens_;
+    // The tree and the lists gathered while parsing live in the arena; the
+    // FormulaAST gets exactly sized copies of the lists
+    ExprArena arena_;
+    std::pmr::vector<Position> cells_{arena_.GetResource()};
+    std::pmr::vector<CellRange> ranges_{arena_.GetResource()};
+    // The arguments of the function calls being parsed
+    std::pmr::vector<const Expr*> args_{arena_.GetResource()};
+
+    static BinaryPrecedence GetBinaryPrecedence(Tokenizer::TokenKind kind) {
+        switch (kind) {
+            case Tokenizer::Add:
+            case Tokenizer::Sub:
+                return PREC_ADDITIVE;
+            case Tokenizer::Mul:
+            case Tokenizer::Div:
+                return PREC_MULTIPLICATIVE;
+            default:
+                return PREC_NONE;
+        }
+    }
+
+    static BinaryOpExpr::Type GetBinaryType(Tokenizer::TokenKind kind) {
+        switch (kind) {
+            case Tokenizer::Add:
+                return BinaryOpExpr::Add;
+            case Tokenizer::Sub:
+                return BinaryOpExpr::Subtract;
+            case Tokenizer::Mul:
+                return BinaryOpExpr::Multiply;
+            default:
+                assert(kind == Tokenizer::Div);
+                return BinaryOpExpr::Divide;
+        }
+    }
+
+    const Expr* ParseExpression(BinaryPrecedence min_precedence) {
+        auto lhs = ParsePrefix();
+        while (true) {
+            BinaryPrecedence precedence = GetBinaryPrecedence(tokens_.Current().kind);
+            if (precedence == PREC_NONE || precedence < min_precedence) {
+                return lhs;
+            }
+            BinaryOpExpr::Type type = GetBinaryType(tokens_.Current().kind);
+            tokens_.Advance();
+            auto rhs = ParseExpression(static_cast<BinaryPrecedence>(precedence + 1));
+            lhs = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+        }
+    }
 
-        return root;
+    const Expr* ParsePrefix() {
+        switch (tokens_.Current().kind) {
+            case Tokenizer::Add:
+            case Tokenizer::Sub: {
+                auto type = tokens_.Current().kind == Tokenizer::Sub ? UnaryOpExpr::UnaryMinus
+                                                                     : UnaryOpExpr::UnaryPlus;
+                tokens_.Advance();
+                return arena_.Make<UnaryOpExpr>(type, ParsePrefix());
+            }
+            case Tokenizer::LeftParen: {
+                tokens_.Advance();
+                auto expr = ParseExpression(PREC_ADDITIVE);
+                if (tokens_.Current().kind != Tokenizer::RightParen) {
+                    Tokenizer::Fail();
+                }
+                tokens_.Advance();
+                return expr;
+            }
+            case Tokenizer::Cell: {
+                auto value = Position::FromString(tokens_.Current().text);
+                if (!value.IsValid()) {
+                    throw FormulaException("Invalid position: " + std::string(tokens_.Current().text));
+                }
+                tokens_.Advance();
+                cells_.push_back(value);
+                return arena_.Make<CellExpr>(value);
+            }
+            case Tokenizer::Number: {
+                double value = ParseNumber(tokens_.Current().text);
+                tokens_.Advance();
+                return arena_.Make<NumberExpr>(value);
+            }
+            case Tokenizer::Function:
+                return ParseFunctionCall();
+            default:
+                Tokenizer::Fail();
+        }
+    }
+
+    // FUNCTION '(' argument (',' argument)* ')'
+    const Expr* ParseFunctionCall() {
+        auto function = FindFunction(tokens_.Current().text);
+        tokens_.Advance();
+        if (tokens_.Current().kind != Tokenizer::LeftParen) {
+            Tokenizer::Fail();
+        }
+        // nested calls push their arguments above ours and pop them back
+        size_t first_arg = args_.size();
+        do {
+            tokens_.Advance();
+            auto arg = ParseArgument();
+            args_.push_back(arg);
+        } while (tokens_.Current().kind == Tokenizer::Comma);
+        if (tokens_.Current().kind != Tokenizer::RightParen) {
+            Tokenizer::Fail();
+        }
+        tokens_.Advance();
+        size_t arg_count = args_.size() - first_arg;
+        auto args = arena_.MakeArray(args_.data() + first_arg, args_.data() + args_.size());
+        args_.resize(first_arg);
+        return arena_.Make<FunctionExpr>(function, args, arg_count);
     }
 
-    std::forward_list<Position> MoveCells() {
-        return std::move(cells_);
+    // CELL ':' CELL | expr
+    const Expr* ParseArgument() {
+        if (tokens_.Current().kind != Tokenizer::Cell || tokens_.Peek().kind != Tokenizer::Colon) {
+            return ParseExpression(PREC_ADDITIVE);
+        }
+        auto first = tokens_.Current().text;
+        tokens_.Advance();
+        tokens_.Advance();
+        if (tokens_.Current().kind != Tokenizer::Cell) {
+            Tokenizer::Fail();
+        }
+        auto range = MakeRange(first, tokens_.Current().text);
+        tokens_.Advance();
+        ranges_.push_back(range);
+        return arena_.Make<RangeExpr>(range);
+    }
+
+    // Converts the text of a NUMBER token the same way operator>> does in
+    // the ANTLR listener: values too large for double are an error, values
+    // too small to be represented become zero
+    static double ParseNumber(std::string_view text) {
+        double value = 0;
+        auto [end, error] = std::from_chars(text.data(), text.data() + text.size(), value);
+        if (error == std::errc::result_out_of_range) {
+            // the magnitude is below 1 iff the decimal exponent of the first
+            // significant digit is negative
+            size_t exponent_pos = text.find_first_of("eE");
+            std::string_view mantissa = text.substr(0, exponent_pos);
+            int exponent = 0;
+            if (exponent_pos != text.npos) {
+                std::string_view exponent_text = text.substr(exponent_pos + 1);
+                if (!exponent_text.empty() && exponent_text.front() == '+') {
+                    exponent_text.remove_prefix(1);
+                }
+                auto exponent_result =
+                    std::from_chars(exponent_text.data(), exponent_text.data() + exponent_text.size(), exponent);
+                // an exponent beyond int outweighs any mantissa, so only its
+                // sign matters
+                if (exponent_result.ec == std::errc::result_out_of_range) {
+                    if (exponent_text.front() == '-') {
+                        return 0.0;
+                    }
+                    throw FormulaException("Invalid number: " + std::string(text));
+                }
+            }
+            size_t first_significant = mantissa.find_first_not_of("0.");
+            size_t point = std::min(mantissa.find('.'), mantissa.size());
+            int magnitude = static_cast<int>(point) - static_cast<int>(first_significant);
+            if (first_significant > point) {
+                ++magnitude;
+            }
+            if (magnitude + exponent <= 0) {
+                return 0.0;
+            }
+            throw FormulaException("Invalid number: " + std::string(text));
+        }
+        if (error != std::errc() || end != text.data() + text.size()) {
+            throw FormulaException("Invalid number: " + std::string(text));
+        }
+        return value;
+    }
+};
+
+class ParseASTListener final : public FormulaBaseListener {
+public:
+    // The tree lives as long as the listener
+    FormulaAST MakeAST() const {
+        assert(args_.size() == 1);
+        return FormulaAST(*args_.front(), {cells_.begin(), cells_.end()}, {ranges_.begin(), ranges_.end()});
     }
 
 public:
     void exitUnaryOp(FormulaParser::UnaryOpContext* ctx) override {
         assert(args_.size() >= 1);
 
-        auto operand = std::move(args_.back());
+        auto operand = args_.back();
 
         UnaryOpExpr::Type type;
         if (ctx->SUB()) {
@@ -322,8 +1123,7 @@ public:
             type = UnaryOpExpr::UnaryPlus;
         }
 
-        auto node = std::make_unique<UnaryOpExpr>(type, std::move(operand));
-        args_.back() = std::move(node);
+        args_.back() = arena_.Make<UnaryOpExpr>(type, operand);
     }
 
     void exitLiteral(FormulaParser::LiteralContext* ctx) override {
@@ -332,11 +1132,10 @@ public:
         std::istringstream in(valueStr);
         in >> value;
         if (!in) {
-            throw ParsingError("Invalid number: " + valueStr);
+            throw FormulaException("Invalid number: " + valueStr);
         }
 
-        auto node = std::make_unique<NumberExpr>(value);
-        args_.push_back(std::move(node));
+        args_.push_back(arena_.Make<NumberExpr>(value));
     }
 
     void exitCell(FormulaParser::CellContext* ctx) override {
@@ -346,18 +1145,17 @@ public:
             throw FormulaException("Invalid position: " + value_str);
         }
 
-        cells_.push_front(value);
-        auto node = std::make_unique<CellExpr>(&cells_.front());
-        args_.push_back(std::move(node));
+        cells_.push_back(value);
+        args_.push_back(arena_.Make<CellExpr>(value));
     }
 
     void exitBinaryOp(FormulaParser::BinaryOpContext* ctx) override {
         assert(args_.size() >= 2);
 
-        auto rhs = std::move(args_.back());
+        auto rhs = args_.back();
         args_.pop_back();
 
-        auto lhs = std::move(args_.back());
+        auto lhs = args_.back();
 
         BinaryOpExpr::Type type;
         if (ctx->ADD()) {
@@ -371,8 +1169,23 @@ public:
             type = BinaryOpExpr::Divide;
         }
 
-        auto node = std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs));
-        args_.back() = std::move(node);
+        args_.back() = arena_.Make<BinaryOpExpr>(type, lhs, rhs);
+    }
+
+    void exitRange(FormulaParser::RangeContext* ctx) override {
+        auto range = MakeRange(ctx->CELL(0)->getSymbol()->getText(), ctx->CELL(1)->getSymbol()->getText());
+        ranges_.push_back(range);
+        args_.push_back(arena_.Make<RangeExpr>(range));
+    }
+
+    void exitFunctionCall(FormulaParser::FunctionCallContext* ctx) override {
+        auto function = FindFunction(ctx->FUNCTION()->getSymbol()->getText());
+        size_t arg_count = ctx->argument().size();
+        assert(args_.size() >= arg_count);
+
+        auto args = arena_.MakeArray(args_.data() + args_.size() - arg_count, args_.data() + args_.size());
+        args_.resize(args_.size() - arg_count);
+        args_.push_back(arena_.Make<FunctionExpr>(function, args, arg_count));
     }
 
     void visitErrorNode(antlr4::tree::ErrorNode* node) override {
@@ -380,8 +1193,10 @@ public:
     }
 
 private:
-    std::vector<std::unique_ptr<Expr>> args_;
-    std::forward_list<Position> cells_;
+    ExprArena arena_;
+    std::pmr::vector<const Expr*> args_{arena_.GetResource()};
+    std::pmr::vector<Position> cells_{arena_.GetResource()};
+    std::pmr::vector<CellRange> ranges_{arena_.GetResource()};
 };
 
 class BailErrorListener : public antlr4::BaseErrorListener {
@@ -424,10 +1239,58 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     ASTImpl::ParseASTListener listener;
     tree::ParseTreeWalker::DEFAULT.walk(&listener, tree);
 
-    return FormulaAST(listener.MoveRoot(), listener.MoveCells());
+    return listener.MakeAST();
+}
+
+FormulaAST ParseFormulaASTFast(std::string_view in) {
+    return ASTImpl::FastParser(in).Parse();
+}
+
+std::string GetFormulaShapeKey(std::string_view in, Position anchor) {
+    using ASTImpl::Tokenizer;
+
+    std::string key;
+    key.reserve(in.size() + 8);
+    for (Tokenizer tokens(in); tokens.Current().kind != Tokenizer::End; tokens.Advance()) {
+        const auto& token = tokens.Current();
+        if (token.kind == Tokenizer::Cell) {
+            auto pos = Position::FromString(token.text);
+            if (!pos.IsValid()) {
+                throw FormulaException("Invalid position: " + std::string(token.text));
+            }
+            key += 'R';
+            key += std::to_string(pos.row - anchor.row);
+            key += 'C';
+            key += std::to_string(pos.col - anchor.col);
+        } else {
+            key += token.text;
+        }
+        // tokens are separated, otherwise "1 2" and "12" would get one key
+        key += ' ';
+    }
+    return key;
+}
+
+namespace {
+#ifdef SPREADSHEET_USE_ANTLR_PARSER
+std::atomic<FormulaParserKind> formula_parser_kind = FormulaParserKind::Antlr;
+#else
+std::atomic<FormulaParserKind> formula_parser_kind = FormulaParserKind::Fast;
+#endif
+}  // namespace
+
+void SetFormulaParserKind(FormulaParserKind kind) {
+    formula_parser_kind = kind;
+}
+
+FormulaParserKind GetFormulaParserKind() {
+    return formula_parser_kind;
 }
 
 FormulaAST ParseFormulaAST(const std::string& in_str) {
+    if (GetFormulaParserKind() == FormulaParserKind::Fast) {
+        return ParseFormulaASTFast(in_str);
+    }
     std::istringstream in(in_str);
     return ParseFormulaAST(in);
 }
@@ -439,21 +1302,179 @@ void FormulaAST::PrintCells(std::ostream& out) const {
 }
 
 void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+    ASTImpl::ProgramPrinter(program_, Position{}).Print(out);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+    ASTImpl::ProgramPrinter(program_, anchor).PrintFormula(out);
 }
 
-double FormulaAST::Execute(const SheetInterface& sheet) const {
-    return root_expr_->Evaluate(sheet);
+void FormulaAST::MakeRelativeTo(Position anchor) {
+    for (auto& instruction : program_) {
+        if (instruction.code == ASTImpl::Instruction::Cell || instruction.code == ASTImpl::Instruction::AggregateCell) {
+            instruction.operand.cell.row -= anchor.row;
+            instruction.operand.cell.col -= anchor.col;
+        } else if (instruction.code == ASTImpl::Instruction::AggregateRange) {
+            auto& range = instruction.operand.range;
+            range.first_row = static_cast<int16_t>(range.first_row - anchor.row);
+            range.first_col = static_cast<int16_t>(range.first_col - anchor.col);
+            range.last_row = static_cast<int16_t>(range.last_row - anchor.row);
+            range.last_col = static_cast<int16_t>(range.last_col - anchor.col);
+        }
+    }
+    for (auto& cell : cells_) {
+        cell.row -= anchor.row;
+        cell.col -= anchor.col;
+    }
+    for (auto& range : ranges_) {
+        range.first.row -= anchor.row;
+        range.first.col -= anchor.col;
+        range.last.row -= anchor.row;
+        range.last.col -= anchor.col;
+    }
 }
 
-FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
-    : root_expr_(std::move(root_expr))
-    , cells_(std::move(cells)) {
-    cells_.sort();  // to avoid sorting in GetReferencedCells
+FormulaAST::Value FormulaAST::Execute(const SheetInterface& sheet, Position anchor) const {
+    using ASTImpl::Instruction;
+
+    // Formulas rarely need a deep stack, so it usually lives on the C++ stack
+    constexpr size_t SMALL_STACK_SIZE = 32;
+    double small_stack[SMALL_STACK_SIZE];
+    std::unique_ptr<double[]> large_stack;
+    double* stack = small_stack;
+    if (max_stack_depth_ > SMALL_STACK_SIZE) {
+        large_stack = std::make_unique<double[]>(max_stack_depth_);
+        stack = large_stack.get();
+    }
+
+    // Numbers of a range argument are gathered here and then reduced by a
+    // kernel in one pass
+    std::vector<double> range_numbers;
+
+    // Errors are returned as values rather than thrown: the first error met
+    // ends the evaluation, so an error cell costs no more than a number
+    size_t top = 0;
+    for (const Instruction& instruction : program_) {
+        switch (instruction.code) {
+            case Instruction::Number:
+                stack[top++] = instruction.operand.number;
+                continue;
+            case Instruction::Cell: {
+                Value value = ASTImpl::GetCellValue(sheet, anchor, instruction.operand.cell);
+                if (const double* number = std::get_if<double>(&value)) {
+                    stack[top++] = *number;
+                } else {
+                    return value;
+                }
+                continue;
+            }
+            case Instruction::Add:
+                --top;
+                stack[top - 1] += stack[top];
+                break;
+            case Instruction::Subtract:
+                --top;
+                stack[top - 1] -= stack[top];
+                break;
+            case Instruction::Multiply:
+                --top;
+                stack[top - 1] *= stack[top];
+                break;
+            case Instruction::Divide:
+                --top;
+                stack[top - 1] /= stack[top];
+                break;
+            case Instruction::UnaryPlus:
+                break;
+            case Instruction::UnaryMinus:
+                stack[top - 1] = -stack[top - 1];
+                break;
+            case Instruction::AggregateBegin:
+                stack[top++] = ASTImpl::GetAggregateInitialValue(instruction.function);
+                stack[top++] = 0.0;
+                continue;
+            case Instruction::AggregateValue:
+                --top;
+                ASTImpl::Aggregate(instruction.function, &stack[top - 2], &stack[top], 1);
+                continue;
+            case Instruction::AggregateRange: {
+                const auto& range = instruction.operand.range;
+                CellRange cells{{anchor.row + range.first_row, anchor.col + range.first_col},
+                                {anchor.row + range.last_row, anchor.col + range.last_col}};
+                if (!cells.first.IsValid() || !cells.last.IsValid()) {
+                    return FormulaError(FormulaError::Category::Ref);
+                }
+                range_numbers.clear();
+                if (auto error = sheet.CollectRangeNumbers(cells, range_numbers)) {
+                    return *error;
+                }
+                ASTImpl::Aggregate(instruction.function, &stack[top - 2], range_numbers.data(),
+                                   range_numbers.size());
+                continue;
+            }
+            case Instruction::AggregateCell: {
+                // The cell is collected as a one-cell range to be filtered
+                // the same way
+                Position pos{anchor.row + instruction.operand.cell.row, anchor.col + instruction.operand.cell.col};
+                if (!pos.IsValid()) {
+                    return FormulaError(FormulaError::Category::Ref);
+                }
+                range_numbers.clear();
+                if (auto error = sheet.CollectRangeNumbers({pos, pos}, range_numbers)) {
+                    return *error;
+                }
+                ASTImpl::Aggregate(instruction.function, &stack[top - 2], range_numbers.data(),
+                                   range_numbers.size());
+                continue;
+            }
+            case Instruction::AggregateEnd:
+                --top;
+                stack[top - 1] = ASTImpl::GetAggregateResult(instruction.function, &stack[top - 1]);
+                break;
+        }
+        // values pushed by operands are finite, so only a computed result
+        // may overflow; the aggregate state may be infinite until it ends
+        if (!std::isfinite(stack[top - 1])) {
+            return FormulaError(FormulaError::Category::Div0);
+        }
+    }
+    assert(top == 1);
+    return stack[0];
 }
 
-FormulaAST::~FormulaAST() = default;
\ No newline at end of file
+FormulaAST::FormulaAST(const ASTImpl::Expr& root_expr, std::vector<Position> cells,
+                       std::vector<CellRange> ranges)
+    : cells_(std::move(cells))
+    , ranges_(std::move(ranges)) {
+    root_expr.Compile(program_);
+
+    size_t depth = 0;
+    for (const auto& instruction : program_) {
+        depth += ASTImpl::GetStackEffect(instruction);
+        max_stack_depth_ = std::max(max_stack_depth_, depth);
+    }
+
+    std::sort(cells_.begin(), cells_.end());  // to avoid sorting in GetReferencedCells
+}
+
+FormulaAST::~FormulaAST() = default;
+
+size_t FormulaAST::GetMemoryUsage() const {
+    return sizeof(*this) + program_.capacity() * sizeof(ASTImpl::Instruction)
+           + cells_.capacity() * sizeof(Position)
+           + ranges_.capacity() * sizeof(CellRange);
+}
+
+FormulaAST::FormulaAST(std::vector<ASTImpl::Instruction> program)
+    : program_(std::move(program))
+    , max_stack_depth_(ASTImpl::CheckProgram(program_)) {
+    for (const auto& instruction : program_) {
+        if (instruction.code == ASTImpl::Instruction::Cell || instruction.code == ASTImpl::Instruction::AggregateCell) {
+            cells_.push_back({instruction.operand.cell.row, instruction.operand.cell.col});
+        } else if (instruction.code == ASTImpl::Instruction::AggregateRange) {
+            const auto& range = instruction.operand.range;
+            ranges_.push_back({{range.first_row, range.first_col}, {range.last_row, range.last_col}});
+        }
+    }
+    std::sort(cells_.begin(), cells_.end());
+}
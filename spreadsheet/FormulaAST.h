@@ -3,12 +3,75 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
-#include <forward_list>
+#include <cstdint>
 #include <functional>
 #include <stdexcept>
+#include <string_view>
+#include <variant>
+#include <vector>
 
 namespace ASTImpl {
 class Expr;
+
+// An instruction of a compiled formula. The program is the formula in
+// postfix (reverse Polish) order and is executed by a stack machine:
+// operands push a value, operations pop their arguments and push the result.
+//
+// An aggregate function call F(a, b, ...) compiles to
+//     AggregateBegin F, <argument a>, <argument b>, ..., AggregateEnd F
+// where a range argument is a single AggregateRange instruction, a bare cell
+// reference is a single AggregateCell instruction and any other argument is
+// its expression followed by AggregateValue. A cell argument is thus filtered
+// like a one-cell range: empty cells and non-numeric text are skipped. The
+// running state of the aggregate occupies two stack slots between Begin and
+// End.
+struct Instruction {
+    enum Code : uint8_t {
+        Number,          // push operand.number
+        Cell,            // push the value of operand.cell
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        UnaryPlus,
+        UnaryMinus,
+        AggregateBegin,  // push the initial state of the aggregate
+        AggregateValue,  // pop a value and add it to the aggregate
+        AggregateRange,  // add the numbers of operand.range to the aggregate
+        AggregateCell,   // add the number in operand.cell, if any, to the aggregate
+        AggregateEnd,    // replace the aggregate state with its result
+    };
+
+    enum Function : uint8_t {
+        Sum,
+        Average,
+        Min,
+        Max,
+        Count,
+    };
+
+    struct CellRef {
+        int row;
+        int col;
+    };
+
+    // Corners of a range. Both absolute positions and offsets between
+    // positions fit in 16 bits, which keeps the instruction small
+    struct RangeRef {
+        int16_t first_row;
+        int16_t first_col;
+        int16_t last_row;
+        int16_t last_col;
+    };
+
+    Code code;
+    Function function;  // for the Aggregate* instructions
+    union {
+        double number;
+        CellRef cell;
+        RangeRef range;
+    } operand;
+};
 }
 
 class ParsingError : public std::runtime_error {
@@ -17,33 +80,89 @@ class ParsingError : public std::runtime_error {
 
 class FormulaAST {
 public:
-    explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
-                        std::forward_list<Position> cells);
+    using Value = std::variant<double, FormulaError>;
+
+    // Compiles the expression tree; the FormulaAST does not refer to the
+    // tree afterwards. cells lists the references in the tree.
+    explicit FormulaAST(const ASTImpl::Expr& root_expr,
+                        std::vector<Position> cells,
+                        std::vector<CellRange> ranges = {});
+    // Restores a formula from the program returned by GetProgram(), e.g.
+    // one read from a sheet snapshot; the cells and ranges are taken from
+    // the program itself. Throws FormulaException unless the program is
+    // well-formed: every instruction is known and finite, the stack never
+    // underflows, aggregates are properly nested and exactly one value is
+    // left at the end.
+    explicit FormulaAST(std::vector<ASTImpl::Instruction> program);
     FormulaAST(FormulaAST&&) = default;
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    double Execute(const SheetInterface& sheet) const;
+    // Rewrites the cell references as offsets from anchor, so that one
+    // program can be shared by all cells where the formula has the same
+    // relative shape (=A1*B1 in C1 and =A2*B2 in C2). Execute, PrintFormula,
+    // GetCells and GetRanges are then relative to the anchor passed to them.
+    void MakeRelativeTo(Position anchor);
+
+    // Returns the value of the formula or the first error met while
+    // evaluating it; never throws FormulaError
+    Value Execute(const SheetInterface& sheet, Position anchor = {}) const;
     void PrintCells(std::ostream& out) const;
     void Print(std::ostream& out) const;
-    void PrintFormula(std::ostream& out) const;
+    void PrintFormula(std::ostream& out, Position anchor = {}) const;
 
-    std::forward_list<Position>& GetCells() {
+    // The cell references, sorted; a cell referenced twice is listed twice
+    const std::vector<Position>& GetCells() const {
         return cells_;
     }
 
-    const std::forward_list<Position>& GetCells() const {
-        return cells_;
+    // The ranges used by aggregate functions, in the order of appearance
+    const std::vector<CellRange>& GetRanges() const {
+        return ranges_;
+    }
+
+    const std::vector<ASTImpl::Instruction>& GetProgram() const {
+        return program_;
     }
 
+    // Bytes held by the formula, the object itself included; an estimate,
+    // since allocator overhead is not known
+    size_t GetMemoryUsage() const;
+
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    // The expression tree built by the parser is compiled into a flat
+    // program and is not kept: both evaluation and printing work on the
+    // program, which lives in a single contiguous allocation
+    std::vector<ASTImpl::Instruction> program_;
+    size_t max_stack_depth_ = 0;
 
     // physically stores cells so that they can be
     // efficiently traversed without going through
     // the whole AST
-    std::forward_list<Position> cells_;
+    std::vector<Position> cells_;
+    std::vector<CellRange> ranges_;
 };
 
+// Parses a formula with the ANTLR-generated parser
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+// Parses a formula with the hand-written parser. Produces the same AST and
+// throws FormulaException for the same inputs as the ANTLR parser.
+FormulaAST ParseFormulaASTFast(std::string_view in);
+
+// Selects the parser used by ParseFormulaAST(const std::string&). The default
+// is the hand-written parser unless the project is configured with
+// SPREADSHEET_FAST_FORMULA_PARSER=OFF.
+enum class FormulaParserKind {
+    Antlr,
+    Fast,
+};
+void SetFormulaParserKind(FormulaParserKind kind);
+FormulaParserKind GetFormulaParserKind();
+
+FormulaAST ParseFormulaAST(const std::string& in_str);
+
+// Returns the key of the shape of a formula written in the cell anchor: its
+// tokens with the cell references replaced by offsets from the anchor.
+// Formulas with equal keys compile to the same relative program. Throws
+// FormulaException on an invalid token or cell reference.
+std::string GetFormulaShapeKey(std::string_view in, Position anchor);
\ No newline at end of file
@@ -0,0 +1,391 @@
+// Замеры горячих путей таблицы. Каждый сценарий повторяется несколько раз
+// на свежей таблице, а результат выводится в stdout по строке JSON на
+// сценарий:
+//     {"scenario":"chain_recalculate","operations":160000,"repetitions":5,
+//      "ns_per_op_min":...,"ns_per_op_median":...,"allocations_per_op":...,
+//      "bytes_allocated_per_op":...,"peak_rss_kib":...}
+// Операция - единица работы сценария (записанная, вычисленная или
+// напечатанная ячейка, разобранная формула). Выделения памяти считаются
+// заменённым operator new за лучший прогон. Пиковый RSS - максимум для всего
+// процесса к концу сценария, поэтому для точного значения сценарий лучше
+// запускать отдельным процессом:
+//     spreadsheet_benchmark [--repetitions N] [--list] [сценарий...]
+// Входные данные сценариев детерминированы, так что результаты разных
+// сборок сравнимы между собой.
+
+#include "common.h"
+#include "formula.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+namespace {
+std::atomic<uint64_t> allocation_count{0};
+std::atomic<uint64_t> allocated_bytes{0};
+}
+
+void* operator new(std::size_t size) {
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (void* ptr = std::malloc(size == 0 ? 1 : size)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    std::free(ptr);
+}
+
+namespace {
+const int DEFAULT_REPETITIONS = 5;
+// Число изменений исходной ячейки в сценариях пересчёта
+const int RECALCULATION_ROUNDS = 10;
+
+using Clock = std::chrono::steady_clock;
+
+// Результат одного прогона сценария. Время и выделения памяти копятся
+// только между Start() и Stop(), так что подготовка таблицы в замер не
+// попадает.
+class Measurement {
+public:
+    void Start() {
+        start_allocations_ = allocation_count.load(std::memory_order_relaxed);
+        start_bytes_ = allocated_bytes.load(std::memory_order_relaxed);
+        start_ = Clock::now();
+    }
+
+    void Stop() {
+        elapsed_ += Clock::now() - start_;
+        allocations_ += allocation_count.load(std::memory_order_relaxed) - start_allocations_;
+        bytes_ += allocated_bytes.load(std::memory_order_relaxed) - start_bytes_;
+    }
+
+    void AddOperations(uint64_t count) {
+        operations_ += count;
+    }
+
+    uint64_t GetOperations() const {
+        return operations_;
+    }
+
+    double GetNanoseconds() const {
+        return std::chrono::duration<double, std::nano>(elapsed_).count();
+    }
+
+    uint64_t GetAllocations() const {
+        return allocations_;
+    }
+
+    uint64_t GetBytes() const {
+        return bytes_;
+    }
+
+private:
+    Clock::time_point start_;
+    Clock::duration elapsed_{};
+    uint64_t start_allocations_ = 0;
+    uint64_t start_bytes_ = 0;
+    uint64_t allocations_ = 0;
+    uint64_t bytes_ = 0;
+    uint64_t operations_ = 0;
+};
+
+// Поток, отбрасывающий всё записанное: печать замеряется без роста строки
+class NullBuffer : public std::streambuf {
+protected:
+    int_type overflow(int_type c) override {
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char*, std::streamsize count) override {
+        return count;
+    }
+};
+
+std::string Ref(int row, int col) {
+    return Position{row, col}.ToString();
+}
+
+// Изменяет исходную ячейку и пересчитывает таблицу RECALCULATION_ROUNDS раз.
+// Операция - вычисленная формула.
+void MeasureRecalculation(SheetInterface& sheet, Position source, Measurement& measurement) {
+    sheet.Recalculate();
+    for (int round = 0; round < RECALCULATION_ROUNDS; ++round) {
+        measurement.Start();
+        sheet.SetCell(source, std::to_string(round + 2));
+        RecalculationReport report = sheet.Recalculate();
+        measurement.Stop();
+        measurement.AddOperations(report.evaluated_cells);
+    }
+}
+
+// Цепочка A2=A1+1, A3=A2+1, ... во весь столбец, записываемая по ячейке
+void ChainBuild(Measurement& measurement) {
+    auto sheet = CreateSheet();
+    sheet->SetCell({0, 0}, "1");
+    measurement.Start();
+    for (int row = 1; row < Position::MAX_ROWS; ++row) {
+        sheet->SetCell({row, 0}, "=" + Ref(row - 1, 0) + "+1");
+    }
+    measurement.Stop();
+    measurement.AddOperations(Position::MAX_ROWS - 1);
+}
+
+void ChainRecalculate(Measurement& measurement) {
+    auto sheet = CreateSheet();
+    std::vector<std::pair<Position, std::string>> cells = {{{0, 0}, "1"}};
+    for (int row = 1; row < Position::MAX_ROWS; ++row) {
+        cells.push_back({{row, 0}, "=" + Ref(row - 1, 0) + "+1"});
+    }
+    sheet->SetCells(std::move(cells));
+    MeasureRecalculation(*sheet, {0, 0}, measurement);
+}
+
+// 10000 формул, ссылающихся на одну ячейку
+void FanOutRecalculate(Measurement& measurement) {
+    auto sheet = CreateSheet();
+    std::vector<std::pair<Position, std::string>> cells = {{{0, 0}, "1"}};
+    for (int row = 0; row < 100; ++row) {
+        for (int col = 1; col <= 100; ++col) {
+            cells.push_back({{row, col}, "=A1*" + std::to_string(col)});
+        }
+    }
+    sheet->SetCells(std::move(cells));
+    MeasureRecalculation(*sheet, {0, 0}, measurement);
+}
+
+// Слои ромбов: каждая ячейка ссылается на две соседние ячейки строки выше
+void DiamondRecalculate(Measurement& measurement) {
+    const int width = 50;
+    const int depth = 200;
+    auto sheet = CreateSheet();
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int col = 0; col < width; ++col) {
+        cells.push_back({{0, col}, "1"});
+    }
+    for (int row = 1; row < depth; ++row) {
+        for (int col = 0; col < width; ++col) {
+            cells.push_back({{row, col}, "=" + Ref(row - 1, col) + "+" + Ref(row - 1, (col + 1) % width)});
+        }
+    }
+    sheet->SetCells(std::move(cells));
+    MeasureRecalculation(*sheet, {0, 0}, measurement);
+}
+
+// Таблица 500 x 200 из чисел и короткого текста
+std::vector<std::pair<Position, std::string>> MakeTextCells() {
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < 500; ++row) {
+        for (int col = 0; col < 200; ++col) {
+            cells.push_back({{row, col}, (row + col) % 3 == 0 ? "text" + std::to_string(col) : std::to_string(row * col)});
+        }
+    }
+    return cells;
+}
+
+void BulkTextSetCells(Measurement& measurement) {
+    auto cells = MakeTextCells();
+    measurement.AddOperations(cells.size());
+    auto sheet = CreateSheet();
+    measurement.Start();
+    sheet->SetCells(std::move(cells));
+    measurement.Stop();
+}
+
+void BulkTextImport(Measurement& measurement) {
+    auto cells = MakeTextCells();
+    measurement.AddOperations(cells.size());
+    std::string tsv;
+    for (const auto& [pos, text] : cells) {
+        tsv += text;
+        tsv += pos.col == 199 ? '\n' : '\t';
+    }
+    std::istringstream input(tsv);
+    auto sheet = CreateSheet();
+    measurement.Start();
+    sheet->ImportTable(input, TableFormat::Tsv);
+    measurement.Stop();
+}
+
+// Записи в случайные ячейки по всей таблице, в том числе в дальние углы.
+// Почти каждая запись занимает отдельный блок хранилища, поэтому записей
+// немного: иначе сценарий упирается в объём памяти
+void FarCornerWrites(Measurement& measurement) {
+    const int count = 2000;
+    std::mt19937 random(42);
+    std::vector<Position> positions;
+    for (int i = 0; i < count; ++i) {
+        int row = static_cast<int>(random() % Position::MAX_ROWS);
+        int col = static_cast<int>(random() % Position::MAX_COLS);
+        positions.push_back({row, col});
+    }
+    auto sheet = CreateSheet();
+    measurement.Start();
+    for (const Position& pos : positions) {
+        sheet->SetCell(pos, "far");
+    }
+    measurement.Stop();
+    measurement.AddOperations(count);
+}
+
+// Разбор различных формул без интернирования программ
+void FormulaParse(Measurement& measurement) {
+    const int count = 20000;
+    std::vector<std::string> expressions;
+    for (int i = 0; i < count; ++i) {
+        int row = i % 1000;
+        expressions.push_back("(" + Ref(row, 0) + "+" + Ref(row, 1) + "*" + std::to_string(i) + ".5)/SUM(C1:"
+                              + Ref(row + 1, 2) + ")-MAX(" + Ref(row, 3) + "," + std::to_string(i % 7) + ")");
+    }
+    measurement.Start();
+    for (std::string& expression : expressions) {
+        ParseFormula(std::move(expression));
+    }
+    measurement.Stop();
+    measurement.AddOperations(count);
+}
+
+// Печать значений таблицы 1000 x 50 из чисел, текста и формул
+void PrintValues(Measurement& measurement) {
+    const int rows = 1000;
+    const int cols = 50;
+    auto sheet = CreateSheet();
+    std::vector<std::pair<Position, std::string>> cells;
+    for (int row = 0; row < rows; ++row) {
+        for (int col = 0; col < cols; ++col) {
+            std::string text;
+            switch (col % 4) {
+            case 0:
+                text = std::to_string(row * 0.25 + col);
+                break;
+            case 1:
+                text = "label";
+                break;
+            default:
+                text = "=" + Ref(row, col - 1) + "/3";
+            }
+            cells.push_back({{row, col}, std::move(text)});
+        }
+    }
+    sheet->SetCells(std::move(cells));
+    sheet->Recalculate();
+
+    NullBuffer buffer;
+    std::ostream output(&buffer);
+    measurement.Start();
+    for (int round = 0; round < 5; ++round) {
+        sheet->PrintValues(output);
+    }
+    measurement.Stop();
+    measurement.AddOperations(5 * rows * cols);
+}
+
+struct Scenario {
+    std::string_view name;
+    void (*run)(Measurement&);
+};
+
+const Scenario SCENARIOS[] = {
+    {"chain_build", ChainBuild},
+    {"chain_recalculate", ChainRecalculate},
+    {"fan_out_recalculate", FanOutRecalculate},
+    {"diamond_recalculate", DiamondRecalculate},
+    {"bulk_text_set_cells", BulkTextSetCells},
+    {"bulk_text_import", BulkTextImport},
+    {"far_corner_writes", FarCornerWrites},
+    {"formula_parse", FormulaParse},
+    {"print_values", PrintValues},
+};
+
+long GetPeakRssKib() {
+#ifdef _WIN32
+    return 0;
+#else
+    rusage usage = {};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+#endif
+}
+
+void RunScenario(const Scenario& scenario, int repetitions) {
+    std::vector<Measurement> runs;
+    for (int i = 0; i < repetitions; ++i) {
+        scenario.run(runs.emplace_back());
+    }
+    std::sort(runs.begin(), runs.end(), [](const Measurement& lhs, const Measurement& rhs) {
+        return lhs.GetNanoseconds() < rhs.GetNanoseconds();
+    });
+    const Measurement& best = runs.front();
+    const Measurement& median = runs[runs.size() / 2];
+    double operations = static_cast<double>(std::max<uint64_t>(best.GetOperations(), 1));
+
+    std::cout << "{\"scenario\":\"" << scenario.name << "\""
+              << ",\"operations\":" << best.GetOperations()
+              << ",\"repetitions\":" << repetitions
+              << ",\"ns_per_op_min\":" << best.GetNanoseconds() / operations
+              << ",\"ns_per_op_median\":" << median.GetNanoseconds() / operations
+              << ",\"allocations_per_op\":" << best.GetAllocations() / operations
+              << ",\"bytes_allocated_per_op\":" << best.GetBytes() / operations
+              << ",\"peak_rss_kib\":" << GetPeakRssKib() << "}" << std::endl;
+}
+}  // namespace
+
+int main(int argc, char** argv) {
+    int repetitions = DEFAULT_REPETITIONS;
+    std::vector<const Scenario*> selected;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (arg == "--list") {
+            for (const Scenario& scenario : SCENARIOS) {
+                std::cout << scenario.name << '\n';
+            }
+            return 0;
+        }
+        if (arg == "--repetitions" && i + 1 < argc) {
+            repetitions = std::max(1, std::atoi(argv[++i]));
+            continue;
+        }
+        auto it = std::find_if(std::begin(SCENARIOS), std::end(SCENARIOS), [arg](const Scenario& scenario) {
+            return scenario.name == arg;
+        });
+        if (it == std::end(SCENARIOS)) {
+            std::cerr << "Unknown scenario " << arg << '\n';
+            return 1;
+        }
+        selected.push_back(&*it);
+    }
+    if (selected.empty()) {
+        for (const Scenario& scenario : SCENARIOS) {
+            selected.push_back(&scenario);
+        }
+    }
+
+    std::cout.precision(6);
+    for (const Scenario* scenario : selected) {
+        RunScenario(*scenario, repetitions);
+    }
+}
@@ -1,74 +1,91 @@
 #include "cell.h"
 
-#include <cassert>
-#include <iostream>
+#include <chrono>
 #include <string>
 #include <optional>
 
-Cell::Cell()
-    : impl_(std::make_unique<EmptyImpl>())
-    , sheet_ptr_(nullptr)
-{}
-
-Cell::Cell(const SheetInterface* sheet_ptr) 
-    : impl_(std::make_unique<EmptyImpl>())
-    , sheet_ptr_(sheet_ptr)
-{}
-
-Cell::Cell(Cell&& other)
-    : impl_(std::move(other.impl_))
-    , sheet_ptr_(other.sheet_ptr_)
-{}
-
-Cell::~Cell() = default;
-
-void Cell::Set(std::string text, const SheetInterface* sheet_ptr) {
-    sheet_ptr_ = sheet_ptr;
+void Cell::Set(std::string text, Position pos, const CellContext* context) {
     if (text.empty()) {
         Clear();
-        type_ = Empty;
         return;
     }
 
-    if (text[0] == FORMULA_SIGN) {
-        if (text.length() > 1) {
-            // reset() requires raw pointer
-            impl_.reset(new FormulaImpl(text.substr(1), sheet_ptr_));
-            type_ = Formula;
-        }
-        else {
-            impl_.reset(new TextImpl(std::move(text)));
-            type_ = Text;
-        }
+    if (text[0] == FORMULA_SIGN && text.length() > 1) {
+        auto start = std::chrono::steady_clock::now();
+        CellFormula formula = ParseCellFormula(std::string_view(text).substr(1), pos);
+        auto parse_time = std::chrono::steady_clock::now() - start;
+        context->counters->Add(StatsCounters::FormulasParsed);
+        context->counters->Add(StatsCounters::ParseNanoseconds,
+                               std::chrono::duration_cast<std::chrono::nanoseconds>(parse_time).count());
+        impl_.emplace<FormulaImpl>(std::move(formula), context);
     }
     else {
-        impl_.reset(new TextImpl(std::move(text)));
-        type_ = Text;
+        impl_.emplace<TextImpl>(std::move(text));
     }
 }
 
+void Cell::SetFormula(CellFormula formula, const CellContext* context,
+                      std::optional<NumericValue> cached_value) {
+    impl_.emplace<FormulaImpl>(std::move(formula), context, cached_value);
+}
+
 void Cell::Clear() {
-    impl_.reset(new EmptyImpl());
+    impl_.emplace<EmptyImpl>();
 }
 
 Cell::Value Cell::GetValue() const {
-    return impl_->GetValue();
+    return std::visit([](const auto& impl) { return impl.GetValue(); }, impl_);
+}
+
+Cell::NumericValue Cell::GetNumericValue() const {
+    return std::visit([](const auto& impl) { return impl.GetNumericValue(); }, impl_);
 }
 
 std::string Cell::GetText() const {
-    return impl_->GetText();
+    return std::visit([](const auto& impl) { return impl.GetText(); }, impl_);
 }
 
 void Cell::InvalidateCache() {
-    impl_->InvalidateCache();
+    std::visit([](auto& impl) { impl.InvalidateCache(); }, impl_);
+}
+
+bool Cell::IsCached() const {
+    return std::visit([](const auto& impl) { return impl.IsCached(); }, impl_);
 }
 
 Cell::Type Cell::GetType() const {
-    return type_;
+    return static_cast<Type>(impl_.index());
 }
 
 std::vector<Position> Cell::GetReferencedCells() const {
-    return impl_->GetReferencedCells();
+    return std::visit([](const auto& impl) { return impl.GetReferencedCells(); }, impl_);
+}
+
+std::vector<CellRange> Cell::GetReferencedRanges() const {
+    return std::visit([](const auto& impl) { return impl.GetReferencedRanges(); }, impl_);
+}
+
+std::optional<Cell::NumericValue> Cell::GetNumericValueInRange() const {
+    return std::visit([](const auto& impl) { return impl.GetNumericValueInRange(); }, impl_);
+}
+
+std::string_view Cell::GetTextView() const {
+    const TextImpl* text = std::get_if<TextImpl>(&impl_);
+    return text ? text->GetTextView() : std::string_view();
+}
+
+std::string_view Cell::GetValueView() const {
+    const TextImpl* text = std::get_if<TextImpl>(&impl_);
+    return text ? text->GetValueView() : std::string_view();
+}
+
+const CellFormula* Cell::GetFormula() const {
+    const FormulaImpl* formula = std::get_if<FormulaImpl>(&impl_);
+    return formula ? &formula->GetFormula() : nullptr;
+}
+
+size_t Cell::GetHeapSize() const {
+    return std::visit([](const auto& impl) { return impl.GetHeapSize(); }, impl_);
 }
 
 CellInterface::Value EmptyImpl::GetValue() const {
@@ -76,6 +93,10 @@ CellInterface::Value EmptyImpl::GetValue() const {
     return ""s;
 }
 
+CellInterface::NumericValue EmptyImpl::GetNumericValue() const {
+    return 0.0;
+}
+
 std::string EmptyImpl::GetText() const {
     using namespace std::literals;
     return ""s;
@@ -93,15 +114,41 @@ std::vector<Position> EmptyImpl::GetReferencedCells() const {
     return {};
 }
 
+std::vector<CellRange> EmptyImpl::GetReferencedRanges() const {
+    return {};
+}
+
+std::optional<CellInterface::NumericValue> EmptyImpl::GetNumericValueInRange() const {
+    return std::nullopt;
+}
+
+size_t EmptyImpl::GetHeapSize() const {
+    return 0;
+}
+
+namespace {
+CellInterface::NumericValue ClassifyText(std::string_view value) {
+    if (value.empty()) {
+        return 0.0;
+    }
+    if (auto number = ParseNumericText(value)) {
+        return *number;
+    }
+    return FormulaError(FormulaError::Category::Value);
+}
+}  // namespace
+
 TextImpl::TextImpl(std::string text)
     : text_(std::move(text))
+    , numeric_value_(ClassifyText(text_[0] == ESCAPE_SIGN ? std::string_view(text_).substr(1) : text_))
 {}
 
 CellInterface::Value TextImpl::GetValue() const {
-    if (text_[0] == ESCAPE_SIGN) {
-        return text_.substr(1);
-    }
-    return text_;
+    return std::string(GetValueView());
+}
+
+CellInterface::NumericValue TextImpl::GetNumericValue() const {
+    return numeric_value_;
 }
 
 std::string TextImpl::GetText() const {
@@ -120,28 +167,61 @@ std::vector<Position> TextImpl::GetReferencedCells() const {
     return {};
 }
 
-FormulaImpl::FormulaImpl(std::string expression, const SheetInterface* sheet_ptr)
-    : formula_(ParseFormula(expression))
-    , sheet_ptr_(sheet_ptr)
+std::vector<CellRange> TextImpl::GetReferencedRanges() const {
+    return {};
+}
+
+std::optional<CellInterface::NumericValue> TextImpl::GetNumericValueInRange() const {
+    // Пустой текст (только экранирующий символ) в диапазоне не считается нулём
+    if (!std::holds_alternative<double>(numeric_value_) || (text_.size() == 1 && text_[0] == ESCAPE_SIGN)) {
+        return std::nullopt;
+    }
+    return numeric_value_;
+}
+
+size_t TextImpl::GetHeapSize() const {
+    // Короткая строка лежит внутри объекта
+    static const size_t inline_capacity = std::string().capacity();
+    return text_.capacity() > inline_capacity ? text_.capacity() + 1 : 0;
+}
+
+std::string_view TextImpl::GetTextView() const {
+    return text_;
+}
+
+std::string_view TextImpl::GetValueView() const {
+    std::string_view value = text_;
+    if (value[0] == ESCAPE_SIGN) {
+        value.remove_prefix(1);
+    }
+    return value;
+}
+
+FormulaImpl::FormulaImpl(CellFormula formula, const CellContext* context,
+                         std::optional<FormulaInterface::Value> cached_value)
+    : formula_(std::move(formula))
+    , context_(context)
+    , cached_value_(cached_value)
 {}
 
 CellInterface::Value FormulaImpl::GetValue() const {
+    return std::visit([](auto value) { return CellInterface::Value(value); }, GetNumericValue());
+}
+
+CellInterface::NumericValue FormulaImpl::GetNumericValue() const {
     if (IsCached()) {
-        return *cached_value_;
-    }
-    FormulaInterface::Value res = formula_->Evaluate(*sheet_ptr_);
-    if (std::holds_alternative<double>(res)) {
-        cached_value_ = std::get<double>(res);
+        context_->counters->Add(StatsCounters::CacheHits);
     }
     else {
-        cached_value_ = std::get<FormulaError>(res);
+        cached_value_ = formula_.Evaluate(*context_->sheet);
+        context_->counters->Add(StatsCounters::FormulaEvaluations);
     }
     return *cached_value_;
 }
 
 std::string FormulaImpl::GetText() const {
     using namespace std::literals;
-    return "="s + formula_->GetExpression();
+    return "="s + formula_.GetExpression();
 }
 
 bool FormulaImpl::IsCached() const {
@@ -153,5 +233,21 @@ void FormulaImpl::InvalidateCache() {
 }
 
 std::vector<Position> FormulaImpl::GetReferencedCells() const {
-    return formula_->GetReferencedCells();
-}
\ No newline at end of file
+    return formula_.GetReferencedCells();
+}
+
+std::vector<CellRange> FormulaImpl::GetReferencedRanges() const {
+    return formula_.GetReferencedRanges();
+}
+
+std::optional<CellInterface::NumericValue> FormulaImpl::GetNumericValueInRange() const {
+    return GetNumericValue();
+}
+
+size_t FormulaImpl::GetHeapSize() const {
+    return 0;
+}
+
+const CellFormula& FormulaImpl::GetFormula() const {
+    return formula_;
+}
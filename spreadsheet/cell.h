@@ -2,84 +2,131 @@
 
 #include "common.h"
 #include "formula.h"
+#include "stats_counters.h"
 #include <optional>
+#include <string_view>
+#include <variant>
 
-class Impl;
+// Окружение формульных ячеек таблицы: таблица, по которой вычисляются
+// формулы, и её счётчики. Принадлежит таблице и общее для всех её ячеек,
+// поэтому формульная ячейка хранит лишь указатель на него.
+struct CellContext {
+    const SheetInterface* sheet = nullptr;
+    StatsCounters* counters = nullptr;
+};
+
+// Реализации состояний ячейки. Это обычные (не виртуальные) классы, которые
+// хранятся внутри ячейки по значению в std::variant: пустая ячейка не
+// занимает памяти в куче, короткий текст укладывается в small string
+// optimization std::string, а формульная ячейка хранит только свою позицию и
+// указатель на программу, общую для всех формул той же формы.
+class EmptyImpl {
+public:
+    CellInterface::Value GetValue() const;
+    CellInterface::NumericValue GetNumericValue() const;
+    std::string GetText() const;
+    bool IsCached() const;
+    void InvalidateCache();
+    std::vector<Position> GetReferencedCells() const;
+    std::vector<CellRange> GetReferencedRanges() const;
+    std::optional<CellInterface::NumericValue> GetNumericValueInRange() const;
+    size_t GetHeapSize() const;
+};
+
+class TextImpl {
+public:
+    explicit TextImpl(std::string text);
+    CellInterface::Value GetValue() const;
+    CellInterface::NumericValue GetNumericValue() const;
+    std::string GetText() const;
+    bool IsCached() const;
+    void InvalidateCache();
+    std::vector<Position> GetReferencedCells() const;
+    std::vector<CellRange> GetReferencedRanges() const;
+    std::optional<CellInterface::NumericValue> GetNumericValueInRange() const;
+    size_t GetHeapSize() const;
+    std::string_view GetTextView() const;
+    std::string_view GetValueView() const;
+
+private:
+    std::string text_;
+    // Числовая трактовка текста, вычисленная один раз при создании
+    CellInterface::NumericValue numeric_value_;
+};
+
+class FormulaImpl {
+public:
+    FormulaImpl(CellFormula formula, const CellContext* context,
+                std::optional<FormulaInterface::Value> cached_value = std::nullopt);
+    CellInterface::Value GetValue() const;
+    CellInterface::NumericValue GetNumericValue() const;
+    std::string GetText() const;
+    bool IsCached() const;
+    void InvalidateCache();
+    std::vector<Position> GetReferencedCells() const;
+    std::vector<CellRange> GetReferencedRanges() const;
+    std::optional<CellInterface::NumericValue> GetNumericValueInRange() const;
+    size_t GetHeapSize() const;
+    const CellFormula& GetFormula() const;
+
+private:
+    CellFormula formula_;
+    const CellContext* context_; // Необходимо для работы Evaluate
+    mutable std::optional<FormulaInterface::Value> cached_value_;
+};
 
 class Cell : public CellInterface {
 public:
+    // Порядок совпадает с порядком альтернатив в Cell::impl_
     enum Type {
         Empty,
         Text,
         Formula
     };
 
-    Cell();
-    explicit Cell(const SheetInterface* sheet_ptr);
-    Cell(Cell&& other);
-    Cell(Cell& other) = delete;
+    Cell() = default;
+    Cell(Cell&& other) = default;
+    Cell& operator=(Cell&& other) = default;
     Cell(const Cell& other) = delete;
-    ~Cell(); 
+    Cell& operator=(const Cell& other) = delete;
+    ~Cell() = default;
 
-    void Set(std::string text, const SheetInterface* sheet_ptr_);
+    // pos -- позиция ячейки, относительно которой формула хранит ссылки.
+    // Бросает FormulaException, если формула синтаксически некорректна.
+    // В этом случае состояние ячейки не изменяется.
+    void Set(std::string text, Position pos, const CellContext* context);
+    // Делает ячейку формульной без разбора текста, например при загрузке
+    // снимка таблицы. cached_value - известное значение формулы.
+    void SetFormula(CellFormula formula, const CellContext* context,
+                    std::optional<NumericValue> cached_value = std::nullopt);
     void Clear();
 
     Value GetValue() const override;
+    NumericValue GetNumericValue() const override;
     std::string GetText() const override;
     void InvalidateCache() override;
+    bool IsCached() const;
     Type GetType() const;
 
     std::vector<Position> GetReferencedCells() const override;
+    std::vector<CellRange> GetReferencedRanges() const override;
 
-private:
-    std::unique_ptr<Impl> impl_;
-    const SheetInterface* sheet_ptr_; // необходимо для работы FormulaInteface::Evaluate
-    Type type_;
-};
-
-class Impl {
-public:
-    virtual CellInterface::Value GetValue() const = 0;
-    virtual std::string GetText() const = 0;
-    virtual bool IsCached() const = 0;
-    virtual void InvalidateCache() = 0;
-    virtual std::vector<Position> GetReferencedCells() const = 0;
-};
-
-class EmptyImpl: public Impl {
-public:
-    explicit EmptyImpl() = default;
-    CellInterface::Value GetValue() const override;
-    std::string GetText() const override;
-    bool IsCached() const override;
-    void InvalidateCache() override;
-    std::vector<Position> GetReferencedCells() const override;
-};
+    // Значение ячейки для агрегатной функции над диапазоном (см.
+    // SheetInterface::CollectRangeNumbers). std::nullopt означает, что ячейка
+    // пропускается: она пуста или содержит текст, не являющийся числом.
+    std::optional<NumericValue> GetNumericValueInRange() const;
 
-class TextImpl: public Impl {
-public:
-    explicit TextImpl(std::string text);
-    CellInterface::Value GetValue() const override;
-    std::string GetText() const override;
-    bool IsCached() const override;
-    void InvalidateCache() override;
-    std::vector<Position> GetReferencedCells() const override;
+    // Текст и значение текстовой ячейки без копирования строки. Для ячеек
+    // других типов возвращают пустую строку: текст формулы не хранится, а
+    // строится при каждом вызове GetText().
+    std::string_view GetTextView() const;
+    std::string_view GetValueView() const;
+    // Формула ячейки либо nullptr, если ячейка не формульная
+    const CellFormula* GetFormula() const;
+    // Память в куче, принадлежащая только этой ячейке (длинный текст).
+    // Программы формул общие и сюда не входят.
+    size_t GetHeapSize() const;
 
 private:
-    std::string text_;
+    std::variant<EmptyImpl, TextImpl, FormulaImpl> impl_;
 };
-
-class FormulaImpl: public Impl {
-public:
-    FormulaImpl(std::string expression, const SheetInterface* sheet_ptr_);
-    CellInterface::Value GetValue() const override;
-    std::string GetText() const override;
-    bool IsCached() const override;
-    void InvalidateCache() override;
-    std::vector<Position> GetReferencedCells() const override;
-
-private:
-    std::unique_ptr<FormulaInterface> formula_;
-    const SheetInterface* sheet_ptr_; // Необходимо для работы Evaluate
-    mutable std::optional<CellInterface::Value> cached_value_;
-};
\ No newline at end of file
@@ -0,0 +1,525 @@
+#pragma once
+
+#include "bit_utils.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+#include <iterator>
+#include <new>
+#include <stdexcept>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Позиция, упакованная в 32 бита: строка в старших битах, столбец - в
+// младших COL_BITS. Неявно преобразуется в Position и обратно, так что
+// служит ключом таблиц ниже без изменений в вызывающем коде. Позиция должна
+// быть корректной.
+class CellKey {
+public:
+    static constexpr int COL_BITS = 14;
+
+    constexpr CellKey(Position pos)
+        : value_(static_cast<uint32_t>(pos.row) << COL_BITS | static_cast<uint32_t>(pos.col)) {
+    }
+
+    constexpr operator Position() const {
+        return {static_cast<int>(value_ >> COL_BITS), static_cast<int>(value_ & COL_MASK)};
+    }
+
+    constexpr uint32_t GetValue() const {
+        return value_;
+    }
+
+    constexpr bool operator==(CellKey rhs) const {
+        return value_ == rhs.value_;
+    }
+
+    constexpr bool operator!=(CellKey rhs) const {
+        return value_ != rhs.value_;
+    }
+
+private:
+    static constexpr uint32_t COL_MASK = (1u << COL_BITS) - 1;
+
+    uint32_t value_;
+};
+
+static_assert(Position::MAX_COLS <= 1 << CellKey::COL_BITS);
+static_assert(static_cast<uint64_t>(Position::MAX_ROWS) << CellKey::COL_BITS <= uint64_t{1} << 32);
+
+// Хеш-таблица с открытой адресацией, общая часть CellMap и CellSet. Устроена
+// как SwissTable: все элементы лежат в одном массиве, а для каждого места
+// хранится управляющий байт - пусто, удалено или 7 бит хеша ключа. Места
+// разбиты на группы по GROUP_SIZE; поиск сравнивает управляющие байты целой
+// группы одной SSE2-инструкцией (без SSE2 - побайтно) и обращается к
+// элементам только при совпадении этих 7 бит. Группы перебираются с
+// растущим шагом, пока не встретится группа со свободным местом.
+template <typename Slot>
+class CellHashTable {
+public:
+    static constexpr size_t GROUP_SIZE = 16;
+
+    template <typename TableSlot>
+    class Iterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = std::remove_const_t<TableSlot>;
+        using difference_type = std::ptrdiff_t;
+        using pointer = TableSlot*;
+        using reference = TableSlot&;
+
+        Iterator() = default;
+
+        // Неконстантный итератор преобразуется в константный
+        template <typename OtherSlot, typename = std::enable_if_t<std::is_same_v<const OtherSlot, TableSlot>>>
+        Iterator(const Iterator<OtherSlot>& other)
+            : control_(other.control_)
+            , slots_(other.slots_)
+            , index_(other.index_)
+            , capacity_(other.capacity_) {
+        }
+
+        TableSlot& operator*() const {
+            return slots_[index_];
+        }
+
+        TableSlot* operator->() const {
+            return &slots_[index_];
+        }
+
+        Iterator& operator++() {
+            ++index_;
+            SkipFree();
+            return *this;
+        }
+
+        Iterator operator++(int) {
+            Iterator result = *this;
+            ++*this;
+            return result;
+        }
+
+        bool operator==(const Iterator& rhs) const {
+            return index_ == rhs.index_;
+        }
+
+        bool operator!=(const Iterator& rhs) const {
+            return index_ != rhs.index_;
+        }
+
+    private:
+        friend class CellHashTable;
+        template <typename>
+        friend class Iterator;
+
+        Iterator(const int8_t* control, TableSlot* slots, size_t index, size_t capacity)
+            : control_(control)
+            , slots_(slots)
+            , index_(index)
+            , capacity_(capacity) {
+        }
+
+        void SkipFree() {
+            while (index_ < capacity_ && control_[index_] < 0) {
+                ++index_;
+            }
+        }
+
+        const int8_t* control_ = nullptr;
+        TableSlot* slots_ = nullptr;
+        size_t index_ = 0;
+        size_t capacity_ = 0;
+    };
+
+    using value_type = Slot;
+    using iterator = Iterator<Slot>;
+    using const_iterator = Iterator<const Slot>;
+
+    CellHashTable() = default;
+
+    CellHashTable(const CellHashTable& other) {
+        reserve(other.size_);
+        for (const Slot& slot : other) {
+            InsertNew(Hash(KeyOf(slot)), slot);
+        }
+    }
+
+    CellHashTable(CellHashTable&& other) noexcept {
+        Swap(other);
+    }
+
+    CellHashTable& operator=(CellHashTable other) noexcept {
+        Swap(other);
+        return *this;
+    }
+
+    ~CellHashTable() {
+        DestroySlots();
+        ::operator delete(control_);
+    }
+
+    iterator begin() {
+        iterator it(control_, slots_, 0, capacity_);
+        it.SkipFree();
+        return it;
+    }
+
+    iterator end() {
+        return iterator(control_, slots_, capacity_, capacity_);
+    }
+
+    const_iterator begin() const {
+        return const_cast<CellHashTable*>(this)->begin();
+    }
+
+    const_iterator end() const {
+        return const_cast<CellHashTable*>(this)->end();
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    // Выделяет место под count элементов, чтобы вставка не перестраивала таблицу
+    void reserve(size_t count) {
+        size_t capacity = GROUP_SIZE;
+        while (GetMaxSize(capacity) < count) {
+            capacity *= 2;
+        }
+        if (capacity > capacity_) {
+            Rehash(capacity);
+        }
+    }
+
+    // Большая таблица освобождает память, чтобы обход опустевшей таблицы не
+    // стоил прежнего числа мест
+    void clear() {
+        if (capacity_ > MAX_KEPT_CAPACITY) {
+            CellHashTable().Swap(*this);
+            return;
+        }
+        DestroySlots();
+        ResetControl();
+    }
+
+    iterator find(CellKey key) {
+        size_t index = FindIndex(key);
+        return iterator(control_, slots_, index, capacity_);
+    }
+
+    const_iterator find(CellKey key) const {
+        return const_cast<CellHashTable*>(this)->find(key);
+    }
+
+    size_t count(CellKey key) const {
+        return FindIndex(key) != capacity_ ? 1 : 0;
+    }
+
+    void erase(const_iterator it) {
+        EraseIndex(it.index_);
+    }
+
+    size_t erase(CellKey key) {
+        size_t index = FindIndex(key);
+        if (index == capacity_) {
+            return 0;
+        }
+        EraseIndex(index);
+        return 1;
+    }
+
+    // Память массива мест и управляющих байтов, без памяти, принадлежащей
+    // самим элементам
+    size_t GetMemoryUsage() const {
+        return capacity_ * (1 + sizeof(Slot));
+    }
+
+protected:
+    // Вставляет элемент, если ключа ещё нет. Аргументы используются, только
+    // если элемент создаётся.
+    template <typename... Args>
+    std::pair<iterator, bool> Emplace(CellKey key, Args&&... args) {
+        if (size_t index = FindIndex(key); index != capacity_) {
+            return {iterator(control_, slots_, index, capacity_), false};
+        }
+        if (growth_left_ == 0) {
+            // Если место занято в основном удалёнными элементами, таблица
+            // перестраивается в том же размере
+            Rehash(size_ + 1 > GetMaxSize(capacity_) / 2 ? std::max(capacity_ * 2, GROUP_SIZE) : capacity_);
+        }
+        size_t index = InsertNew(Hash(key), std::forward<Args>(args)...);
+        return {iterator(control_, slots_, index, capacity_), true};
+    }
+
+private:
+    static constexpr int8_t EMPTY = -128;
+    static constexpr int8_t DELETED = -2;
+    static constexpr size_t MAX_KEPT_CAPACITY = 128;
+
+    // Управляющие байты и места лежат в одном блоке: сначала capacity_ байтов,
+    // затем места
+    int8_t* control_ = nullptr;
+    Slot* slots_ = nullptr;
+    size_t capacity_ = 0;
+    size_t size_ = 0;
+    // Сколько ещё пустых мест можно занять, не превысив заполнение 7/8
+    size_t growth_left_ = 0;
+
+    static_assert(alignof(Slot) <= GROUP_SIZE);
+
+    static CellKey KeyOf(CellKey key) {
+        return key;
+    }
+
+    template <typename T>
+    static CellKey KeyOf(const std::pair<const CellKey, T>& slot) {
+        return slot.first;
+    }
+
+    static uint64_t Hash(CellKey key) {
+        // Умножение на нечётную константу перемешивает биты ключа в старшие
+        // разряды, сдвиг возвращает их в младшие
+        uint64_t hash = key.GetValue() * uint64_t{0x9E3779B97F4A7C15};
+        return hash ^ (hash >> 32);
+    }
+
+    static int8_t GetTag(uint64_t hash) {
+        return static_cast<int8_t>(hash & 0x7F);
+    }
+
+    static size_t GetMaxSize(size_t capacity) {
+        return capacity - capacity / 8;
+    }
+
+    // Маска мест группы, управляющий байт которых равен tag
+    static uint32_t Match(const int8_t* group, int8_t tag) {
+#ifdef __SSE2__
+        __m128i control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        return static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8(tag))));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_SIZE; ++i) {
+            mask |= static_cast<uint32_t>(group[i] == tag) << i;
+        }
+        return mask;
+#endif
+    }
+
+    // Маска пустых и удалённых мест группы: у них и только у них управляющий
+    // байт отрицателен
+    static uint32_t MatchFree(const int8_t* group) {
+#ifdef __SSE2__
+        __m128i control = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        return static_cast<uint32_t>(_mm_movemask_epi8(control));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < GROUP_SIZE; ++i) {
+            mask |= static_cast<uint32_t>(group[i] < 0) << i;
+        }
+        return mask;
+#endif
+    }
+
+    // Возвращает индекс места с ключом либо capacity_, если ключа нет
+    size_t FindIndex(CellKey key) const {
+        if (size_ == 0) {
+            return capacity_;
+        }
+        uint64_t hash = Hash(key);
+        int8_t tag = GetTag(hash);
+        size_t group_mask = capacity_ / GROUP_SIZE - 1;
+        size_t group = (hash >> 7) & group_mask;
+        // Шаг растёт на единицу, поэтому при числе групп - степени двойки -
+        // будут просмотрены все группы
+        for (size_t step = 1;; ++step) {
+            const int8_t* control = control_ + group * GROUP_SIZE;
+            for (uint32_t match = Match(control, tag); match != 0; match &= match - 1) {
+                size_t index = group * GROUP_SIZE + GetLowestSetBit(match);
+                if (KeyOf(slots_[index]) == key) {
+                    return index;
+                }
+            }
+            if (Match(control, EMPTY) != 0) {
+                return capacity_;
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+
+    // Первое пустое или удалённое место на пути поиска ключа с хешем hash
+    size_t FindFreeIndex(uint64_t hash) const {
+        size_t group_mask = capacity_ / GROUP_SIZE - 1;
+        size_t group = (hash >> 7) & group_mask;
+        for (size_t step = 1;; ++step) {
+            if (uint32_t free = MatchFree(control_ + group * GROUP_SIZE); free != 0) {
+                return group * GROUP_SIZE + GetLowestSetBit(free);
+            }
+            group = (group + step) & group_mask;
+        }
+    }
+
+    // Создаёт элемент, которого нет в таблице, на первом свободном месте.
+    // Свободное место должно найтись без перестройки.
+    template <typename... Args>
+    size_t InsertNew(uint64_t hash, Args&&... args) {
+        size_t index = FindFreeIndex(hash);
+        new (slots_ + index) Slot(std::forward<Args>(args)...);
+        if (control_[index] == EMPTY) {
+            --growth_left_;
+        }
+        control_[index] = GetTag(hash);
+        ++size_;
+        return index;
+    }
+
+    void EraseIndex(size_t index) {
+        slots_[index].~Slot();
+        --size_;
+        // Поиск не проходит дальше группы, в которой есть пустое место, так
+        // что в такой группе место можно сразу считать пустым
+        const int8_t* group = control_ + index / GROUP_SIZE * GROUP_SIZE;
+        if (Match(group, EMPTY) != 0) {
+            control_[index] = EMPTY;
+            ++growth_left_;
+        }
+        else {
+            control_[index] = DELETED;
+        }
+    }
+
+    void Rehash(size_t capacity) {
+        CellHashTable table;
+        table.control_ = static_cast<int8_t*>(::operator new(capacity * (1 + sizeof(Slot))));
+        table.slots_ = reinterpret_cast<Slot*>(table.control_ + capacity);
+        table.capacity_ = capacity;
+        table.ResetControl();
+        for (size_t i = 0; i < capacity_; ++i) {
+            if (control_[i] >= 0) {
+                table.InsertNew(Hash(KeyOf(slots_[i])), std::move(slots_[i]));
+            }
+        }
+        Swap(table);
+    }
+
+    void ResetControl() {
+        if (capacity_ > 0) {
+            std::memset(control_, static_cast<unsigned char>(EMPTY), capacity_);
+        }
+        size_ = 0;
+        growth_left_ = GetMaxSize(capacity_);
+    }
+
+    void DestroySlots() {
+        if constexpr (!std::is_trivially_destructible_v<Slot>) {
+            for (size_t i = 0; i < capacity_; ++i) {
+                if (control_[i] >= 0) {
+                    slots_[i].~Slot();
+                }
+            }
+        }
+    }
+
+    void Swap(CellHashTable& other) noexcept {
+        std::swap(control_, other.control_);
+        std::swap(slots_, other.slots_);
+        std::swap(capacity_, other.capacity_);
+        std::swap(size_, other.size_);
+        std::swap(growth_left_, other.growth_left_);
+    }
+};
+
+// Отображение из позиций ячеек; замена std::unordered_map<Position, T>
+// с тем же подмножеством интерфейса. Итераторы и ссылки на элементы
+// становятся недействительными при вставке.
+template <typename T>
+class CellMap : public CellHashTable<std::pair<const CellKey, T>> {
+    using Base = CellHashTable<std::pair<const CellKey, T>>;
+
+public:
+    using typename Base::const_iterator;
+    using typename Base::iterator;
+
+    template <typename... Args>
+    std::pair<iterator, bool> try_emplace(CellKey key, Args&&... args) {
+        return this->Emplace(key, std::piecewise_construct, std::forward_as_tuple(key),
+                             std::forward_as_tuple(std::forward<Args>(args)...));
+    }
+
+    template <typename Value>
+    std::pair<iterator, bool> emplace(CellKey key, Value&& value) {
+        return try_emplace(key, std::forward<Value>(value));
+    }
+
+    T& operator[](CellKey key) {
+        return try_emplace(key).first->second;
+    }
+
+    T& at(CellKey key) {
+        auto it = this->find(key);
+        if (it == this->end()) {
+            throw std::out_of_range("CellMap::at");
+        }
+        return it->second;
+    }
+
+    const T& at(CellKey key) const {
+        return const_cast<CellMap*>(this)->at(key);
+    }
+};
+
+// Множество позиций ячеек; замена std::unordered_set<Position>. Элементы
+// множества не меняются через итераторы.
+class CellSet : private CellHashTable<CellKey> {
+    using Base = CellHashTable<CellKey>;
+
+public:
+    using value_type = CellKey;
+    using iterator = Base::const_iterator;
+    using const_iterator = Base::const_iterator;
+
+    CellSet() = default;
+
+    CellSet(std::initializer_list<CellKey> keys) {
+        reserve(keys.size());
+        for (CellKey key : keys) {
+            insert(key);
+        }
+    }
+
+    std::pair<iterator, bool> insert(CellKey key) {
+        return Emplace(key, key);
+    }
+
+    const_iterator begin() const {
+        return Base::begin();
+    }
+
+    const_iterator end() const {
+        return Base::end();
+    }
+
+    const_iterator find(CellKey key) const {
+        return Base::find(key);
+    }
+
+    using Base::clear;
+    using Base::count;
+    using Base::empty;
+    using Base::erase;
+    using Base::GetMemoryUsage;
+    using Base::reserve;
+    using Base::size;
+};
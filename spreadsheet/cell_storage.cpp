@@ -0,0 +1,81 @@
+#include "cell_storage.h"
+
+#include <cassert>
+
+Cell* CellStorage::Find(Position pos) {
+    Chunk* chunk = FindChunk(pos);
+    if (!chunk) {
+        return nullptr;
+    }
+    auto& cell = chunk->cells[GetIndexInChunk(pos)];
+    return cell ? &*cell : nullptr;
+}
+
+const Cell* CellStorage::Find(Position pos) const {
+    return const_cast<CellStorage*>(this)->Find(pos);
+}
+
+Cell& CellStorage::GetOrCreate(Position pos) {
+    assert(pos.IsValid());
+    auto& chunk_row = directory_[pos.row / CHUNK_SIZE];
+    if (!chunk_row) {
+        chunk_row = std::make_unique<ChunkRow>();
+    }
+    auto& chunk = (*chunk_row)[pos.col / CHUNK_SIZE];
+    if (!chunk) {
+        chunk = std::make_unique<Chunk>();
+        ++chunk_count_;
+    }
+    auto& cell = chunk->cells[GetIndexInChunk(pos)];
+    if (!cell) {
+        cell.emplace();
+        ++chunk->cell_count;
+        ++cell_count_;
+    }
+    return *cell;
+}
+
+void CellStorage::Erase(Position pos) {
+    Chunk* chunk = FindChunk(pos);
+    if (!chunk) {
+        return;
+    }
+    auto& cell = chunk->cells[GetIndexInChunk(pos)];
+    if (!cell) {
+        return;
+    }
+    cell.reset();
+    --cell_count_;
+    if (--chunk->cell_count == 0) {
+        (*directory_[pos.row / CHUNK_SIZE])[pos.col / CHUNK_SIZE].reset();
+        --chunk_count_;
+    }
+}
+
+size_t CellStorage::GetCellCount() const {
+    return cell_count_;
+}
+
+size_t CellStorage::GetChunkCount() const {
+    return chunk_count_;
+}
+
+size_t CellStorage::GetMemoryUsage() const {
+    size_t chunk_rows = std::count_if(directory_.begin(), directory_.end(), [](const auto& chunk_row) {
+        return chunk_row != nullptr;
+    });
+    return sizeof(*this) + chunk_rows * sizeof(ChunkRow) + chunk_count_ * sizeof(Chunk);
+}
+
+CellStorage::Chunk* CellStorage::FindChunk(Position pos) const {
+    assert(pos.IsValid());
+    const auto& chunk_row = directory_[pos.row / CHUNK_SIZE];
+    if (!chunk_row) {
+        return nullptr;
+    }
+    return (*chunk_row)[pos.col / CHUNK_SIZE].get();
+}
+
+int CellStorage::GetIndexInChunk(Position pos) {
+    return (pos.row % CHUNK_SIZE) * CHUNK_SIZE + pos.col % CHUNK_SIZE;
+}
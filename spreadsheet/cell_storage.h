@@ -0,0 +1,110 @@
+#pragma once
+
+#include "cell.h"
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <optional>
+
+// Разреженное хранилище ячеек. Таблица разбита на квадратные блоки
+// CHUNK_SIZE x CHUNK_SIZE, которые выделяются только при первой записи в них.
+// Доступ к блоку идёт через двухуровневый каталог (строка блоков -> блок),
+// поэтому запись в любую, даже самую дальнюю, ячейку стоит O(1), а расход
+// памяти пропорционален числу занятых блоков, а не размеру таблицы.
+class CellStorage {
+public:
+    static constexpr int CHUNK_SIZE = 32;
+    static constexpr int CHUNK_ROWS = Position::MAX_ROWS / CHUNK_SIZE;
+    static constexpr int CHUNK_COLS = Position::MAX_COLS / CHUNK_SIZE;
+
+    CellStorage() = default;
+    CellStorage(const CellStorage&) = delete;
+    CellStorage& operator=(const CellStorage&) = delete;
+
+    // Возвращает ячейку либо nullptr, если ячейка не создана.
+    // Позиция должна быть корректной.
+    Cell* Find(Position pos);
+    const Cell* Find(Position pos) const;
+
+    // Возвращает ячейку, при необходимости создавая пустую ячейку
+    // (и блок, в котором она лежит).
+    Cell& GetOrCreate(Position pos);
+
+    // Удаляет ячейку. Блок освобождается, как только в нём не остаётся ячеек.
+    void Erase(Position pos);
+
+    size_t GetCellCount() const;
+    size_t GetChunkCount() const;
+    // Память каталога и блоков, без памяти, принадлежащей самим ячейкам
+    size_t GetMemoryUsage() const;
+
+    // Вызывает f(int col, const Cell&) для существующих ячеек строки row в
+    // столбцах [0, col_count) по возрастанию столбца. Незанятые блоки
+    // пропускаются целиком.
+    template <typename F>
+    void ForEachInRow(int row, int col_count, F f) const;
+
+    // Вызывает f(Position, const Cell&) для всех существующих ячеек, блок
+    // за блоком
+    template <typename F>
+    void ForEachCell(F f) const;
+
+private:
+    struct Chunk {
+        std::array<std::optional<Cell>, CHUNK_SIZE * CHUNK_SIZE> cells;
+        int cell_count = 0;
+    };
+    using ChunkRow = std::array<std::unique_ptr<Chunk>, CHUNK_COLS>;
+
+    std::array<std::unique_ptr<ChunkRow>, CHUNK_ROWS> directory_;
+    size_t cell_count_ = 0;
+    size_t chunk_count_ = 0;
+
+    Chunk* FindChunk(Position pos) const;
+    static int GetIndexInChunk(Position pos);
+};
+
+template <typename F>
+void CellStorage::ForEachInRow(int row, int col_count, F f) const {
+    const auto& chunk_row = directory_[row / CHUNK_SIZE];
+    if (!chunk_row) {
+        return;
+    }
+    for (int chunk_col = 0; chunk_col * CHUNK_SIZE < col_count; ++chunk_col) {
+        const Chunk* chunk = (*chunk_row)[chunk_col].get();
+        if (!chunk) {
+            continue;
+        }
+        int first_col = chunk_col * CHUNK_SIZE;
+        int count = std::min(CHUNK_SIZE, col_count - first_col);
+        const auto* cells = chunk->cells.data() + (row % CHUNK_SIZE) * CHUNK_SIZE;
+        for (int i = 0; i < count; ++i) {
+            if (cells[i]) {
+                f(first_col + i, *cells[i]);
+            }
+        }
+    }
+}
+
+template <typename F>
+void CellStorage::ForEachCell(F f) const {
+    for (int chunk_row = 0; chunk_row < CHUNK_ROWS; ++chunk_row) {
+        if (!directory_[chunk_row]) {
+            continue;
+        }
+        for (int chunk_col = 0; chunk_col < CHUNK_COLS; ++chunk_col) {
+            const Chunk* chunk = (*directory_[chunk_row])[chunk_col].get();
+            if (!chunk) {
+                continue;
+            }
+            for (int i = 0; i < CHUNK_SIZE * CHUNK_SIZE; ++i) {
+                if (chunk->cells[i]) {
+                    f(Position{chunk_row * CHUNK_SIZE + i / CHUNK_SIZE, chunk_col * CHUNK_SIZE + i % CHUNK_SIZE},
+                      *chunk->cells[i]);
+                }
+            }
+        }
+    }
+}
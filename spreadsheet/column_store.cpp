@@ -0,0 +1,87 @@
+#include "column_store.h"
+
+#include <cassert>
+
+void ColumnStore::SetNumber(Position pos, double value) {
+    Segment& segment = GetOrCreateSegment(pos);
+    int row = pos.row % SEGMENT_ROWS;
+    uint64_t bit = uint64_t{1} << row % WORD_BITS;
+    uint64_t& numbers = segment.numbers[row / WORD_BITS];
+    uint64_t& pending = segment.pending[row / WORD_BITS];
+    if (!((numbers | pending) & bit)) {
+        ++segment.used_rows;
+    }
+    numbers |= bit;
+    pending &= ~bit;
+    segment.values[row] = value;
+}
+
+void ColumnStore::SetPending(Position pos) {
+    Segment& segment = GetOrCreateSegment(pos);
+    int row = pos.row % SEGMENT_ROWS;
+    uint64_t bit = uint64_t{1} << row % WORD_BITS;
+    uint64_t& numbers = segment.numbers[row / WORD_BITS];
+    uint64_t& pending = segment.pending[row / WORD_BITS];
+    if (!((numbers | pending) & bit)) {
+        ++segment.used_rows;
+    }
+    numbers &= ~bit;
+    pending |= bit;
+}
+
+void ColumnStore::Reset(Position pos) {
+    auto* segment = const_cast<Segment*>(FindSegment(pos.col, pos.row / SEGMENT_ROWS));
+    if (!segment) {
+        return;
+    }
+    int row = pos.row % SEGMENT_ROWS;
+    uint64_t bit = uint64_t{1} << row % WORD_BITS;
+    uint64_t& numbers = segment->numbers[row / WORD_BITS];
+    uint64_t& pending = segment->pending[row / WORD_BITS];
+    if (!((numbers | pending) & bit)) {
+        return;
+    }
+    numbers &= ~bit;
+    pending &= ~bit;
+    // Сегмент без значимых ячеек освобождается
+    if (--segment->used_rows == 0) {
+        (*columns_[pos.col])[pos.row / SEGMENT_ROWS].reset();
+        --segment_count_;
+    }
+}
+
+size_t ColumnStore::GetSegmentCount() const {
+    return segment_count_;
+}
+
+size_t ColumnStore::GetMemoryUsage() const {
+    size_t column_count = std::count_if(columns_.begin(), columns_.end(), [](const auto& column) {
+        return column != nullptr;
+    });
+    return sizeof(*this) + columns_.capacity() * sizeof(columns_[0]) + column_count * sizeof(Column)
+           + segment_count_ * sizeof(Segment);
+}
+
+ColumnStore::Segment& ColumnStore::GetOrCreateSegment(Position pos) {
+    assert(pos.IsValid());
+    if (columns_.size() <= static_cast<size_t>(pos.col)) {
+        columns_.resize(pos.col + 1);
+    }
+    auto& column = columns_[pos.col];
+    if (!column) {
+        column = std::make_unique<Column>();
+    }
+    auto& segment = (*column)[pos.row / SEGMENT_ROWS];
+    if (!segment) {
+        segment = std::make_unique<Segment>();
+        ++segment_count_;
+    }
+    return *segment;
+}
+
+const ColumnStore::Segment* ColumnStore::FindSegment(int col, int segment) const {
+    if (columns_.size() <= static_cast<size_t>(col) || !columns_[col]) {
+        return nullptr;
+    }
+    return (*columns_[col])[segment].get();
+}
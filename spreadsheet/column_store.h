@@ -0,0 +1,113 @@
+#pragma once
+
+#include "bit_utils.h"
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <variant>
+#include <vector>
+
+// Теневое поколоночное хранилище числовых значений ячеек. Каждый столбец
+// разбит на сегменты по SEGMENT_ROWS строк, которые выделяются при первой
+// записи. Сегмент хранит значения подряд в массиве double и две битовые
+// маски: "в ячейке число" и "значение нужно спросить у самой ячейки"
+// (формула, ещё не вычисленная после изменения, или ошибка). Ячейки без
+// обоих битов (пустые и с нечисловым текстом) пропускаются.
+//
+// Хранилище только отражает содержимое таблицы: синхронизацию выполняет
+// Sheet при изменении ячеек, сбросе кэшей и пересчёте. Благодаря ему
+// агрегатные функции читают диапазон сплошными участками памяти, не
+// обращаясь к каждой ячейке.
+class ColumnStore {
+public:
+    static constexpr int SEGMENT_ROWS = 1024;
+
+    ColumnStore() = default;
+    ColumnStore(const ColumnStore&) = delete;
+    ColumnStore& operator=(const ColumnStore&) = delete;
+
+    void SetNumber(Position pos, double value);
+    void SetPending(Position pos);
+    // Ячейка пропускается при чтении диапазонов
+    void Reset(Position pos);
+
+    // Дописывает в numbers числа диапазона по столбцам сверху вниз. Для
+    // ячеек, значение которых нужно спросить у ячейки, вызывается
+    // fallback(Position), возвращающая std::optional<CellInterface::NumericValue>
+    // (std::nullopt - пропустить ячейку). Возвращает первую встреченную ошибку.
+    template <typename Fallback>
+    std::optional<FormulaError> CollectNumbers(CellRange range, std::vector<double>& numbers,
+                                               Fallback fallback) const;
+
+    size_t GetSegmentCount() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    static constexpr int WORD_BITS = 64;
+    static constexpr int SEGMENT_WORDS = SEGMENT_ROWS / WORD_BITS;
+    static constexpr int SEGMENTS_PER_COLUMN = Position::MAX_ROWS / SEGMENT_ROWS;
+
+    struct Segment {
+        std::array<double, SEGMENT_ROWS> values;
+        std::array<uint64_t, SEGMENT_WORDS> numbers = {};
+        std::array<uint64_t, SEGMENT_WORDS> pending = {};
+        int used_rows = 0;
+    };
+    using Column = std::array<std::unique_ptr<Segment>, SEGMENTS_PER_COLUMN>;
+
+    std::vector<std::unique_ptr<Column>> columns_;
+    size_t segment_count_ = 0;
+
+    Segment& GetOrCreateSegment(Position pos);
+    const Segment* FindSegment(int col, int segment) const;
+};
+
+template <typename Fallback>
+std::optional<FormulaError> ColumnStore::CollectNumbers(CellRange range, std::vector<double>& numbers,
+                                                        Fallback fallback) const {
+    for (int col = range.first.col; col <= range.last.col; ++col) {
+        for (int index = range.first.row / SEGMENT_ROWS; index <= range.last.row / SEGMENT_ROWS; ++index) {
+            const Segment* segment = FindSegment(col, index);
+            if (!segment) {
+                continue;
+            }
+            int base = index * SEGMENT_ROWS;
+            int first = std::max(range.first.row - base, 0);
+            int last = std::min(range.last.row - base, SEGMENT_ROWS - 1);
+            for (int word = first / WORD_BITS; word <= last / WORD_BITS; ++word) {
+                int word_first = std::max(first - word * WORD_BITS, 0);
+                int word_last = std::min(last - word * WORD_BITS, WORD_BITS - 1);
+                uint64_t mask = ~uint64_t{0} >> (WORD_BITS - 1 - word_last + word_first) << word_first;
+                uint64_t number_bits = segment->numbers[word] & mask;
+                uint64_t pending_bits = segment->pending[word] & mask;
+                const double* values = segment->values.data() + word * WORD_BITS;
+                if (number_bits == mask) {
+                    // Сплошной участок чисел копируется целиком
+                    numbers.insert(numbers.end(), values + word_first, values + word_last + 1);
+                    continue;
+                }
+                for (uint64_t bits = number_bits | pending_bits; bits != 0; bits &= bits - 1) {
+                    int bit = GetLowestSetBit(bits);
+                    if (number_bits >> bit & 1) {
+                        numbers.push_back(values[bit]);
+                        continue;
+                    }
+                    auto value = fallback(Position{base + word * WORD_BITS + bit, col});
+                    if (!value) {
+                        continue;
+                    }
+                    if (const double* number = std::get_if<double>(&*value)) {
+                        numbers.push_back(*number);
+                    } else {
+                        return std::get<FormulaError>(*value);
+                    }
+                }
+            }
+        }
+    }
+    return std::nullopt;
+}
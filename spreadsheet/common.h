@@ -1,10 +1,13 @@
 #pragma once
 
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <variant>
 #include <vector>
 
@@ -13,23 +16,110 @@ struct Position {
     int row = 0;
     int col = 0;
 
-    bool operator==(Position rhs) const;
-    bool operator<(Position rhs) const;
+    constexpr bool operator==(Position rhs) const;
+    constexpr bool operator<(Position rhs) const;
 
-    bool IsValid() const;
+    constexpr bool IsValid() const;
     std::string ToString() const;
+    // Записывает позицию в out без завершающего нуля и возвращает указатель
+    // за последним записанным символом; для некорректной позиции ничего не
+    // пишет. В out должно быть место для MAX_STRING_LENGTH символов.
+    constexpr char* ToChars(char* out) const;
 
-    static Position FromString(std::string_view str);
+    // Разбирает запись вида "AB12" за один проход, не выделяя памяти.
+    // Возвращает NONE, если запись некорректна.
+    static constexpr Position FromString(std::string_view str);
 
     static const int MAX_ROWS = 16384;
     static const int MAX_COLS = 16384;
+    // Длина самой длинной записи, "XFD16384"
+    static constexpr size_t MAX_STRING_LENGTH = 8;
     static const Position NONE;
+
+private:
+    static constexpr int LETTERS = 'Z' - 'A' + 1;
 };
 
-struct PositionHasher {
-    size_t operator() (const Position& pos) const {
-        return std::hash<int>{}(pos.row) + 13 * std::hash<int>{}(pos.col);
+inline constexpr Position Position::NONE = {-1, -1};
+
+constexpr bool Position::operator==(Position rhs) const {
+    return row == rhs.row && col == rhs.col;
+}
+
+constexpr bool Position::operator<(Position rhs) const {
+    return row < rhs.row || (row == rhs.row && col < rhs.col);
+}
+
+constexpr bool Position::IsValid() const {
+    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
+}
+
+constexpr char* Position::ToChars(char* out) const {
+    if (!IsValid()) {
+        return out;
     }
+    // Столбцы нумеруются буквами без нуля: A..Z, AA..ZZ, AAA..
+    int letter_count = 1;
+    for (int c = col / LETTERS; c > 0; c = (c - 1) / LETTERS) {
+        ++letter_count;
+    }
+    int c = col;
+    for (int i = letter_count - 1; i >= 0; --i) {
+        out[i] = static_cast<char>('A' + c % LETTERS);
+        c = c / LETTERS - 1;
+    }
+    out += letter_count;
+
+    int digit_count = 1;
+    for (int r = (row + 1) / 10; r > 0; r /= 10) {
+        ++digit_count;
+    }
+    int r = row + 1;
+    for (int i = digit_count - 1; i >= 0; --i) {
+        out[i] = static_cast<char>('0' + r % 10);
+        r /= 10;
+    }
+    return out + digit_count;
+}
+
+constexpr Position Position::FromString(std::string_view str) {
+    // Как только номер выходит за пределы таблицы, разбор прекращается,
+    // так что сколь угодно длинная запись не переполняет int
+    size_t i = 0;
+    int col = 0;
+    for (; i < str.size() && str[i] >= 'A' && str[i] <= 'Z'; ++i) {
+        col = col * LETTERS + (str[i] - 'A' + 1);
+        if (col > MAX_COLS) {
+            return NONE;
+        }
+    }
+    if (i == 0 || i == str.size()) {
+        return NONE;
+    }
+    int row = 0;
+    for (; i < str.size(); ++i) {
+        if (str[i] < '0' || str[i] > '9') {
+            return NONE;
+        }
+        row = row * 10 + (str[i] - '0');
+        if (row > MAX_ROWS) {
+            return NONE;
+        }
+    }
+    if (row == 0) {
+        return NONE;
+    }
+    return {row - 1, col - 1};
+}
+
+// Прямоугольный диапазон ячеек от first (левый верхний угол) до last
+// (правый нижний угол) включительно
+struct CellRange {
+    Position first;
+    Position last;
+
+    bool operator==(CellRange rhs) const;
+    bool Contains(Position pos) const;
 };
 
 struct Size {
@@ -79,6 +169,10 @@ public:
     using std::runtime_error::runtime_error;
 };
 
+// Разбирает текст как число. Текст должен целиком состоять из записи
+// конечного числа, поэтому "3D" или "inf" числами не являются.
+std::optional<double> ParseNumericText(std::string_view text);
+
 class CellInterface {
 public:
     // Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
@@ -97,15 +191,75 @@ public:
     virtual std::string GetText() const = 0;
     virtual void InvalidateCache() = 0;
 
+    // Значение ячейки в том виде, в каком его видит ссылающаяся на неё
+    // формула: число либо ошибка. Текст, целиком являющийся конечным числом,
+    // трактуется как это число, пустой текст - как ноль, остальной текст -
+    // как ошибка #VALUE!.
+    using NumericValue = std::variant<double, FormulaError>;
+    // Реализация по умолчанию получает значение через GetValue(); ячейки
+    // могут переопределить метод, чтобы не разбирать текст при каждом вызове.
+    virtual NumericValue GetNumericValue() const;
+
     // Возвращает список ячеек, которые непосредственно задействованы в данной
     // формуле. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек. В случае текстовой ячейки список пуст.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+
+    // Возвращает диапазоны, на которые ссылаются агрегатные функции формулы
+    // (SUM(A1:B10) и т.п.). Ячейки диапазонов не входят в список
+    // GetReferencedCells(). По умолчанию список пуст.
+    virtual std::vector<CellRange> GetReferencedRanges() const;
+};
+
+// Результат пересчёта таблицы методом SheetInterface::Recalculate()
+struct RecalculationReport {
+    // Количество ячеек, помеченных как устаревшие с момента прошлого пересчёта
+    size_t dirty_cells = 0;
+    // Количество формул, которые были вычислены в ходе пересчёта
+    size_t evaluated_cells = 0;
+};
+
+// Статистика работы таблицы (см. SheetInterface::GetStats())
+struct SheetStats {
+    // Вычисления формул, то есть чтения значения формулы мимо кэша, и
+    // чтения, обслуженные кэшем
+    uint64_t formula_evaluations = 0;
+    uint64_t cache_hits = 0;
+    // Операции записи, сбросившие кэши, и число формул, которые они
+    // отметили устаревшими (вместе с транзитивно зависимыми)
+    uint64_t invalidations = 0;
+    uint64_t invalidated_cells = 0;
+    // Вершины графа зависимостей, просмотренные при проверках на циклы
+    uint64_t cycle_check_visits = 0;
+    // Разобранные формулы и суммарное время их разбора. Формула той же
+    // формы, что и уже существующая, тоже считается
+    uint64_t formulas_parsed = 0;
+    uint64_t parse_nanoseconds = 0;
+
+    // Оценка памяти в байтах на момент вызова GetStats(); не сбрасывается
+    size_t cell_bytes = 0;              // ячейки и хранилище
+    size_t formula_program_bytes = 0;   // программы формул таблицы
+    size_t dependency_graph_bytes = 0;  // граф зависимостей
 };
 
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+// Когда таблица вычисляет формулы, значения которых устарели после изменения
+// ячеек
+enum class CalculationPolicy {
+    Lazy,    // при первом чтении значения или при Recalculate()
+    Eager,   // сразу при каждом изменении таблицы
+    Manual,  // только при Recalculate(); до него читаются прежние значения
+};
+
+// Формат текстовой таблицы для SheetInterface::ImportTable()
+enum class TableFormat {
+    Tsv,  // поля разделены табуляцией, как в выводе PrintTexts()
+    Csv,  // поля разделены запятыми; поле в двойных кавычках может содержать
+          // запятые, переводы строк и удвоенные кавычки
+};
+
 // Интерфейс таблицы
 class SheetInterface {
 public:
@@ -126,6 +280,16 @@ public:
     // начать текст со знака "=", но чтобы он не интерпретировался как формула.
     virtual void SetCell(Position pos, std::string text) = 0;
 
+    // Задаёт содержимое сразу нескольких ячеек по тем же правилам, что и
+    // SetCell(). Все формулы разбираются заранее, а проверка на циклические
+    // зависимости и сброс кэшей выполняются один раз для всего пакета.
+    // Изменения применяются атомарно: если хотя бы одна позиция некорректна,
+    // формула синтаксически некорректна или приводит к циклической
+    // зависимости, бросается соответствующее исключение и таблица не
+    // изменяется. Если позиция встречается несколько раз, действует последнее
+    // значение.
+    virtual void SetCells(std::vector<std::pair<Position, std::string>> cells) = 0;
+
     // Возвращает значение ячейки.
     // Если ячейка пуста, может вернуть nullptr.
     virtual const CellInterface* GetCell(Position pos) const = 0;
@@ -141,13 +305,84 @@ public:
     // текстом.
     virtual Size GetPrintableSize() const = 0;
 
+    // Дописывает в numbers числовые значения ячеек диапазона для агрегатных
+    // функций: числа и значения формул, а также текст, целиком являющийся
+    // числом. Пустые ячейки и прочий текст пропускаются. Если в диапазоне есть
+    // ошибка, возвращает её (любую из имеющихся), иначе - std::nullopt.
+    // Реализация по умолчанию обходит ячейки по одной через GetCell().
+    virtual std::optional<FormulaError> CollectRangeNumbers(CellRange range,
+                                                            std::vector<double>& numbers) const;
+
     // Выводит всю таблицу в переданный поток. Столбцы разделяются знаком
     // табуляции. После каждой строки выводится символ перевода строки. Для
     // преобразования ячеек в строку используются методы GetValue() или GetText()
     // соответственно. Пустая ячейка представляется пустой строкой в любом случае.
     virtual void PrintValues(std::ostream& output) const = 0;
     virtual void PrintTexts(std::ostream& output) const = 0;
+
+    // Вычисляет все формулы, значения которых устарели после изменения
+    // таблицы. Ячейки вычисляются в топологическом порядке графа зависимостей,
+    // поэтому каждая из них вычисляется ровно один раз.
+    virtual RecalculationReport Recalculate() = 0;
+
+    // Задаёт число потоков, которыми Recalculate() вычисляет независимые
+    // друг от друга формулы. 1 (по умолчанию) - последовательный пересчёт,
+    // 0 - по числу аппаратных потоков. Результат пересчёта от числа потоков
+    // не зависит.
+    virtual void SetRecalculationThreads(size_t thread_count) = 0;
+
+    // Задаёт политику вычисления формул (по умолчанию Lazy):
+    // * Lazy - изменение только сбрасывает кэши зависимых формул, и каждая
+    //   из них вычисляется при первом чтении или при Recalculate(). Запись
+    //   дешева, а время чтения зависит от числа устаревших формул;
+    // * Eager - после каждого изменения таблица сама вызывает Recalculate(),
+    //   так что чтение никогда не вычисляет формулы;
+    // * Manual - формулы, зависящие от изменённых ячеек, сохраняют прежние
+    //   значения (и в диапазонах), пока не будет вызван Recalculate(). Новая
+    //   формула вычисляется при первом чтении по текущим, возможно
+    //   устаревшим, значениям ячеек.
+    // При переходе из Manual устаревшие значения сбрасываются, при переходе
+    // в Eager таблица сразу пересчитывается.
+    virtual void SetCalculationPolicy(CalculationPolicy policy) = 0;
+    virtual CalculationPolicy GetCalculationPolicy() const = 0;
+
+    // Возвращает счётчики работы таблицы с момента её создания или
+    // последнего ResetStats() и оценку занимаемой памяти. Счётчики ведутся
+    // всегда и почти ничего не стоят; оценка памяти обходит все ячейки.
+    virtual SheetStats GetStats() const = 0;
+    virtual void ResetStats() = 0;
+
+    // Загружает текстовую таблицу, начиная с ячейки A1: строка входа
+    // становится строкой таблицы, поле - текстом ячейки по правилам
+    // SetCell(). Пустое поле очищает ячейку. Вход читается блоками, формулы
+    // разбираются по мере чтения, а граф зависимостей строится, проверяется
+    // на циклы и сбрасывает кэши один раз, после чтения всего входа.
+    // Изменения применяются атомарно и с теми же исключениями, что и в
+    // SetCells(). При ошибке чтения потока бросается std::ios_base::failure.
+    virtual void ImportTable(std::istream& input, TableFormat format) = 0;
+
+    // Записывает таблицу в поток в виде двоичного снимка: тексты ячеек,
+    // скомпилированные программы формул, топологический порядок графа
+    // зависимостей и уже вычисленные значения формул. Снимок читается
+    // функцией LoadSnapshot() без разбора формул и проверки на циклы.
+    // Поток должен быть открыт в двоичном режиме.
+    virtual void SaveSnapshot(std::ostream& output) const = 0;
 };
 
 // Создаёт готовую к работе пустую таблицу.
-std::unique_ptr<SheetInterface> CreateSheet();
\ No newline at end of file
+std::unique_ptr<SheetInterface> CreateSheet();
+
+// Исключение, выбрасываемое при загрузке некорректного или повреждённого
+// снимка таблицы, а также снимка, записанного на машине с другим порядком
+// байт
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Создаёт таблицу из снимка, записанного SaveSnapshot(). Файл отображается
+// в память, и записи снимка читаются прямо из отображения. Формулы, значения
+// которых не попали в снимок, вычисляются лениво или при Recalculate().
+std::unique_ptr<SheetInterface> LoadSnapshot(const std::string& path);
+// То же для снимка, уже находящегося в памяти
+std::unique_ptr<SheetInterface> LoadSnapshotFromMemory(std::string_view data);
\ No newline at end of file
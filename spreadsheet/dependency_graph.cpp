@@ -0,0 +1,338 @@
+#include "dependency_graph.h"
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+namespace {
+const std::vector<Position> EMPTY_CELLS;
+const std::vector<CellRange> EMPTY_RANGES;
+}
+
+bool DependencyGraph::AddPrecedents(Position pos, const std::vector<Position>& cells,
+                                    const std::vector<CellRange>& ranges) {
+    assert(!precedents_.count(pos));
+    if (cells.empty() && ranges.empty()) {
+        return true;
+    }
+    precedents_.emplace(pos, Precedents{});
+    order_[pos] = HasDependents(pos) ? --min_order_ : ++max_order_;
+    ordered_cells_.Add(pos);
+
+    for (const Position& cell : cells) {
+        if (!AddEdge(cell, pos)) {
+            RemovePrecedents(pos);
+            return false;
+        }
+    }
+    for (const CellRange& range : ranges) {
+        if (!AddRangeEdge(range, pos)) {
+            RemovePrecedents(pos);
+            return false;
+        }
+    }
+    return true;
+}
+
+void DependencyGraph::RemovePrecedents(Position pos) {
+    auto it = precedents_.find(pos);
+    if (it == precedents_.end()) {
+        return;
+    }
+    Precedents precedents = std::move(it->second);
+    precedents_.erase(it);
+    edge_count_ -= precedents.cells.size() + precedents.ranges.size();
+
+    for (const Position& precedent : precedents.cells) {
+        auto dependents_it = dependents_.find(precedent);
+        dependents_it->second.erase(pos);
+        if (dependents_it->second.empty()) {
+            dependents_.erase(dependents_it);
+        }
+    }
+    for (const CellRange& range : precedents.ranges) {
+        range_dependents_.Remove(range, pos);
+    }
+    // Ячейка без зависимостей снова стоит раньше всех
+    order_.erase(pos);
+    ordered_cells_.Remove(pos);
+}
+
+void DependencyGraph::RestorePrecedents(Position pos, const std::vector<Position>& cells,
+                                        const std::vector<CellRange>& ranges, int64_t order) {
+    assert(!precedents_.count(pos));
+    if (cells.empty() && ranges.empty()) {
+        return;
+    }
+    precedents_.emplace(pos, Precedents{cells, ranges});
+    order_[pos] = order;
+    ordered_cells_.Add(pos);
+    min_order_ = std::min(min_order_, order);
+    max_order_ = std::max(max_order_, order);
+    for (const Position& cell : cells) {
+        dependents_[cell].insert(pos);
+    }
+    for (const CellRange& range : ranges) {
+        range_dependents_.Add(range, pos);
+    }
+    edge_count_ += cells.size() + ranges.size();
+}
+
+bool DependencyGraph::CheckOrder(Position pos) const {
+    int64_t order = GetOrder(pos);
+    for (const Position& cell : GetPrecedents(pos)) {
+        if (cell == pos || GetOrder(cell) >= order) {
+            return false;
+        }
+    }
+    bool ordered = true;
+    for (const CellRange& range : GetPrecedentRanges(pos)) {
+        if (range.Contains(pos)) {
+            return false;
+        }
+        ordered_cells_.ForEachInRange(range, [&](Position cell) {
+            ordered = order_.at(cell) < order;
+            return ordered;
+        });
+        if (!ordered) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool DependencyGraph::RebuildOrder() {
+    // Число упорядоченных прямых зависимостей каждой вершины, ещё не
+    // получивших номер. Ячейка, на которую формула ссылается и напрямую, и
+    // через диапазон, считается один раз - как и в GetDependents()
+    CellMap<size_t> pending;
+    pending.reserve(order_.size());
+    std::vector<Position> ready;
+    std::vector<Position> precedents;
+    for (const auto& [pos, order] : order_) {
+        precedents.clear();
+        for (const Position& cell : GetPrecedents(pos)) {
+            if (order_.count(cell)) {
+                precedents.push_back(cell);
+            }
+        }
+        for (const CellRange& range : GetPrecedentRanges(pos)) {
+            ordered_cells_.ForEachInRange(range, [&precedents](Position cell) {
+                precedents.push_back(cell);
+                return true;
+            });
+        }
+        std::sort(precedents.begin(), precedents.end());
+        precedents.erase(std::unique(precedents.begin(), precedents.end()), precedents.end());
+        if (precedents.empty()) {
+            ready.push_back(pos);
+        }
+        else {
+            pending.emplace(pos, precedents.size());
+        }
+    }
+
+    // Вершины нумеруются по уровням: ready служит очередью, и в конце в нём
+    // лежат все вершины в топологическом порядке
+    ready.reserve(order_.size());
+    for (size_t i = 0; i < ready.size(); ++i) {
+        for (const Position& dependent : GetDependents(ready[i])) {
+            if (--pending.at(dependent) == 0) {
+                ready.push_back(dependent);
+            }
+        }
+    }
+    visited_count_ += ready.size();
+    // Вершины цикла так и не освободились
+    if (ready.size() < order_.size()) {
+        return false;
+    }
+
+    int64_t order = 0;
+    for (const Position& pos : ready) {
+        order_[pos] = ++order;
+    }
+    min_order_ = 0;
+    max_order_ = order;
+    return true;
+}
+
+const std::vector<Position>& DependencyGraph::GetPrecedents(Position pos) const {
+    auto it = precedents_.find(pos);
+    return it == precedents_.end() ? EMPTY_CELLS : it->second.cells;
+}
+
+const std::vector<CellRange>& DependencyGraph::GetPrecedentRanges(Position pos) const {
+    auto it = precedents_.find(pos);
+    return it == precedents_.end() ? EMPTY_RANGES : it->second.ranges;
+}
+
+std::vector<Position> DependencyGraph::GetDependents(Position pos) const {
+    std::vector<Position> dependents;
+    if (auto it = dependents_.find(pos); it != dependents_.end()) {
+        dependents.assign(it->second.begin(), it->second.end());
+    }
+    size_t direct_count = dependents.size();
+    range_dependents_.ForEachOwner(pos, [&dependents](Position owner) {
+        dependents.push_back(owner);
+    });
+    // Формула может ссылаться на ячейку и напрямую, и через несколько диапазонов
+    size_t range_count = dependents.size() - direct_count;
+    if (range_count > 1 || (range_count == 1 && direct_count > 0)) {
+        std::sort(dependents.begin(), dependents.end());
+        dependents.erase(std::unique(dependents.begin(), dependents.end()), dependents.end());
+    }
+    return dependents;
+}
+
+bool DependencyGraph::HasDependents(Position pos) const {
+    return dependents_.count(pos) > 0 || range_dependents_.IsCovered(pos);
+}
+
+int64_t DependencyGraph::GetOrder(Position pos) const {
+    auto it = order_.find(pos);
+    return it == order_.end() ? std::numeric_limits<int64_t>::min() : it->second;
+}
+
+size_t DependencyGraph::GetEdgeCount() const {
+    return edge_count_;
+}
+
+uint64_t DependencyGraph::GetVisitedCount() const {
+    return visited_count_;
+}
+
+void DependencyGraph::ResetVisitedCount() {
+    visited_count_ = 0;
+}
+
+size_t DependencyGraph::GetMemoryUsage() const {
+    size_t usage = sizeof(*this) + precedents_.GetMemoryUsage() + dependents_.GetMemoryUsage()
+                   + order_.GetMemoryUsage() + range_dependents_.GetMemoryUsage()
+                   + ordered_cells_.GetMemoryUsage();
+    for (const auto& [pos, precedents] : precedents_) {
+        usage += precedents.cells.capacity() * sizeof(Position) + precedents.ranges.capacity() * sizeof(CellRange);
+    }
+    for (const auto& [pos, dependents] : dependents_) {
+        usage += dependents.GetMemoryUsage();
+    }
+    return usage;
+}
+
+bool DependencyGraph::AddEdge(Position from, Position to) {
+    if (from == to) {
+        return false;
+    }
+    // Ячейка без зависимостей стоит раньше всех, и ребро от неё порядок не
+    // нарушает
+    auto from_it = order_.find(from);
+    if (from_it != order_.end() && from_it->second > order_.at(to) && !Reorder(from, to)) {
+        return false;
+    }
+
+    dependents_[from].insert(to);
+    precedents_.at(to).cells.push_back(from);
+    ++edge_count_;
+    return true;
+}
+
+bool DependencyGraph::AddRangeEdge(CellRange range, Position to) {
+    if (range.Contains(to)) {
+        return false;
+    }
+    // Порядок могут нарушить только упорядоченные ячейки диапазона. Каждая
+    // перестройка оставляет прежние ячейки диапазона раньше to
+    bool acyclic = true;
+    ordered_cells_.ForEachInRange(range, [&](Position from) {
+        if (order_.at(from) > order_.at(to) && !Reorder(from, to)) {
+            acyclic = false;
+        }
+        return acyclic;
+    });
+    if (!acyclic) {
+        return false;
+    }
+
+    range_dependents_.Add(range, to);
+    precedents_.at(to).ranges.push_back(range);
+    ++edge_count_;
+    return true;
+}
+
+bool DependencyGraph::Reorder(Position from, Position to) {
+    const int64_t lower_bound = order_.at(to);
+    const int64_t upper_bound = order_.at(from);
+
+    // Ячейки, зависящие от to, которые сейчас стоят не позже from.
+    // Если среди них есть сам from, ребро замыкает цикл
+    std::vector<Position> forward;
+    CellSet visited = {to};
+    std::vector<Position> stack = {to};
+    while (!stack.empty()) {
+        Position pos = stack.back();
+        stack.pop_back();
+        forward.push_back(pos);
+        ++visited_count_;
+        for (const Position& dependent : GetDependents(pos)) {
+            int64_t order = order_.at(dependent);
+            if (order == upper_bound) {
+                return false;
+            }
+            if (order < upper_bound && visited.insert(dependent).second) {
+                stack.push_back(dependent);
+            }
+        }
+    }
+
+    // Ячейки, от которых зависит from, которые сейчас стоят не раньше to
+    std::vector<Position> backward;
+    visited.clear();
+    visited.insert(from);
+    stack = {from};
+    while (!stack.empty()) {
+        Position pos = stack.back();
+        stack.pop_back();
+        backward.push_back(pos);
+        ++visited_count_;
+        auto visit = [&](Position precedent) {
+            auto it = order_.find(precedent);
+            if (it != order_.end() && it->second > lower_bound && visited.insert(precedent).second) {
+                stack.push_back(precedent);
+            }
+            return true;
+        };
+        for (const Position& precedent : GetPrecedents(pos)) {
+            visit(precedent);
+        }
+        for (const CellRange& range : GetPrecedentRanges(pos)) {
+            ordered_cells_.ForEachInRange(range, visit);
+        }
+    }
+
+    // Найденные ячейки получают те же номера, но теперь все ячейки из
+    // backward идут раньше ячеек из forward
+    auto by_order = [this](Position lhs, Position rhs) {
+        return order_.at(lhs) < order_.at(rhs);
+    };
+    std::sort(forward.begin(), forward.end(), by_order);
+    std::sort(backward.begin(), backward.end(), by_order);
+
+    std::vector<int64_t> orders;
+    orders.reserve(forward.size() + backward.size());
+    for (const Position& pos : backward) {
+        orders.push_back(order_.at(pos));
+    }
+    for (const Position& pos : forward) {
+        orders.push_back(order_.at(pos));
+    }
+    std::sort(orders.begin(), orders.end());
+
+    auto order_it = orders.begin();
+    for (const Position& pos : backward) {
+        order_[pos] = *order_it++;
+    }
+    for (const Position& pos : forward) {
+        order_[pos] = *order_it++;
+    }
+    return true;
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include "cell_hash_table.h"
+#include "common.h"
+#include "spatial_index.h"
+
+#include <cstdint>
+#include <vector>
+
+// Граф зависимостей между ячейками. Хранит оба направления рёбер:
+// * precedents - ячейки и диапазоны, на которые непосредственно ссылается
+//   формула;
+// * dependents - ячейки, формулы которых непосредственно ссылаются на данную
+//   или на диапазон, содержащий её.
+// Оба направления обновляются согласованно, поэтому при перезаписи или
+// очистке ячейки её старые рёбра удаляются, и граф содержит только живые
+// зависимости. Диапазон хранится одним прямоугольником в RangeIndex, а не
+// ребром от каждой своей ячейки, так что SUM(A1:A16384) стоит одну запись.
+//
+// Кроме того, граф поддерживает топологический порядок ячеек, у которых есть
+// прямые зависимости (алгоритм Пирса-Келли): каждая такая ячейка получает
+// номер, меньший номеров всех зависящих от неё ячеек. Ячейки без зависимостей
+// стоят раньше всех и в порядке не хранятся - иначе каждая ячейка диапазона
+// стала бы вершиной. При добавлении ребра, нарушающего порядок,
+// перестраивается только участок порядка между его концами, и там же
+// обнаруживаются циклы.
+class DependencyGraph {
+public:
+    // Добавляет рёбра от ячеек cells и диапазонов ranges к ячейке pos, у
+    // которой ещё нет прямых зависимостей. Список cells не должен содержать
+    // повторов. Если новые рёбра образуют цикл, граф остаётся прежним и
+    // возвращается false.
+    bool AddPrecedents(Position pos, const std::vector<Position>& cells, const std::vector<CellRange>& ranges);
+    void RemovePrecedents(Position pos);
+    // Добавляет рёбра к ячейке pos с заданным номером в порядке, без
+    // проверок. Когда все ячейки добавлены, порядок нужно подтвердить:
+    // CheckOrder() для каждой ячейки (при загрузке снимка таблицы) либо
+    // построить заново RebuildOrder() (при массовой загрузке).
+    void RestorePrecedents(Position pos, const std::vector<Position>& cells,
+                           const std::vector<CellRange>& ranges, int64_t order);
+    // Проверяет, что все прямые зависимости ячейки стоят в порядке раньше неё
+    bool CheckOrder(Position pos) const;
+    // Строит топологический порядок всего графа заново за один проход
+    // (алгоритм Кана). Если в графе есть цикл, возвращает false, не меняя
+    // порядок.
+    bool RebuildOrder();
+
+    const std::vector<Position>& GetPrecedents(Position pos) const;
+    const std::vector<CellRange>& GetPrecedentRanges(Position pos) const;
+    // Ячейки, которые ссылаются на pos напрямую или через диапазон, без повторов
+    std::vector<Position> GetDependents(Position pos) const;
+    bool HasDependents(Position pos) const;
+
+    // Номер ячейки в топологическом порядке: если ячейка A зависит от B,
+    // то GetOrder(B) < GetOrder(A). Ячейки без зависимостей идут раньше всех.
+    int64_t GetOrder(Position pos) const;
+
+    // Количество рёбер; диапазон считается одним ребром
+    size_t GetEdgeCount() const;
+
+    // Число вершин, просмотренных при поиске циклов и перестройках порядка
+    // с момента создания графа или последнего ResetVisitedCount()
+    uint64_t GetVisitedCount() const;
+    void ResetVisitedCount();
+    // Оценка памяти, занимаемой графом
+    size_t GetMemoryUsage() const;
+
+private:
+    struct Precedents {
+        std::vector<Position> cells;
+        std::vector<CellRange> ranges;
+    };
+
+    CellMap<Precedents> precedents_;
+    CellMap<CellSet> dependents_;
+    RangeIndex range_dependents_;
+    CellMap<int64_t> order_;
+    // Ячейки из order_, чтобы находить упорядоченные вершины внутри диапазона
+    PositionIndex ordered_cells_;
+    // Новые вершины, от которых ничего не зависит, добавляются в конец
+    // порядка, остальные - в начало, чтобы как можно реже перестраивать порядок
+    int64_t min_order_ = 0;
+    int64_t max_order_ = 0;
+    size_t edge_count_ = 0;
+    uint64_t visited_count_ = 0;
+
+    // Добавляет ребро from -> to (ячейка to ссылается на from).
+    // Возвращает false, не изменяя граф, если ребро замыкает цикл.
+    bool AddEdge(Position from, Position to);
+    // То же для рёбер от всех ячеек диапазона
+    bool AddRangeEdge(CellRange range, Position to);
+    // Восстанавливает топологический порядок перед добавлением ребра
+    // from -> to, если GetOrder(from) > GetOrder(to).
+    bool Reorder(Position from, Position to);
+};
@@ -5,48 +5,165 @@
 #include <algorithm>
 #include <cassert>
 #include <cctype>
+#include <mutex>
 #include <sstream>
+#include <unordered_map>
 
 using namespace std::literals;
 
 std::ostream& operator<<(std::ostream& output, FormulaError fe) {
-    return output << "#DIV/0!";
+    return output << fe.ToString();
 }
 
 namespace {
+// Таблица интернирования программ формул, общая для всех листов. Хранит
+// слабые ссылки: программа живёт, пока её использует хотя бы одна формула,
+// а записи об удалённых программах периодически вычищаются.
+class FormulaInternTable {
+public:
+    std::shared_ptr<const FormulaAST> GetProgram(std::string_view expression, Position anchor) {
+        std::string key = GetFormulaShapeKey(expression, anchor);
+        {
+            std::lock_guard lock(mutex_);
+            auto it = programs_.find(key);
+            if (it != programs_.end()) {
+                if (auto program = it->second.lock()) {
+                    return program;
+                }
+            }
+        }
+
+        // Разбор выполняется без блокировки: он может бросить исключение
+        // и заметно дольше поиска
+        FormulaAST ast = ParseFormulaAST(std::string(expression));
+        ast.MakeRelativeTo(anchor);
+        auto program = std::make_shared<const FormulaAST>(std::move(ast));
+
+        std::lock_guard lock(mutex_);
+        auto& slot = programs_[std::move(key)];
+        if (auto existing = slot.lock()) {
+            return existing;
+        }
+        slot = program;
+        if (programs_.size() >= purge_threshold_) {
+            Purge();
+        }
+        return program;
+    }
+
+    size_t GetShapeCount() const {
+        std::lock_guard lock(mutex_);
+        return std::count_if(programs_.begin(), programs_.end(), [](const auto& entry) {
+            return !entry.second.expired();
+        });
+    }
+
+private:
+    static constexpr size_t MIN_PURGE_THRESHOLD = 1024;
+
+    mutable std::mutex mutex_;
+    std::unordered_map<std::string, std::weak_ptr<const FormulaAST>> programs_;
+    size_t purge_threshold_ = MIN_PURGE_THRESHOLD;
+
+    // Удаляет записи о программах, которые больше не используются. Порог
+    // следующей чистки растёт вместе с таблицей, поэтому чистка амортизированно
+    // стоит O(1) на добавление
+    void Purge() {
+        for (auto it = programs_.begin(); it != programs_.end();) {
+            if (it->second.expired()) {
+                it = programs_.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        purge_threshold_ = std::max(MIN_PURGE_THRESHOLD, 2 * programs_.size());
+    }
+};
+
+FormulaInternTable& GetInternTable() {
+    static FormulaInternTable table;
+    return table;
+}
+
 class Formula : public FormulaInterface {
 public:
-// Реализуйте следующие методы:
     explicit Formula(std::string expression)
-        : ast_(ParseFormulaAST(std::move(expression)))
+        : formula_(ParseCellFormula(expression, Position{}))
     {}
 
-    Value Evaluate(const SheetInterface& sheet) const override  { // TODO
-        try {
-            return ast_.Execute(sheet);
-        } catch (const FormulaError& exc) {
-            return exc;
-        }
+    Value Evaluate(const SheetInterface& sheet) const override {
+        return formula_.Evaluate(sheet);
     }
 
     std::string GetExpression() const override {
-        std::stringstream ss;
-        ast_.PrintFormula(ss);
-        return ss.str();
+        return formula_.GetExpression();
     }
 
     std::vector<Position> GetReferencedCells() const override {
-        std::vector<Position> result = {ast_.GetCells().begin(), ast_.GetCells().end()};
-        auto new_end = std::unique(result.begin(), result.end());
-        result.erase(new_end, result.end());
-        return result;
+        return formula_.GetReferencedCells();
+    }
+
+    std::vector<CellRange> GetReferencedRanges() const override {
+        return formula_.GetReferencedRanges();
     }
 
 private:
-    FormulaAST ast_;
+    CellFormula formula_;
 };
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
     return std::make_unique<Formula>(std::move(expression));
-}
\ No newline at end of file
+}
+
+CellFormula::CellFormula(std::shared_ptr<const FormulaAST> program, Position anchor)
+    : program_(std::move(program))
+    , anchor_(anchor)
+{}
+
+FormulaInterface::Value CellFormula::Evaluate(const SheetInterface& sheet) const {
+    return program_->Execute(sheet, anchor_);
+}
+
+std::string CellFormula::GetExpression() const {
+    std::stringstream ss;
+    program_->PrintFormula(ss, anchor_);
+    return ss.str();
+}
+
+std::vector<Position> CellFormula::GetReferencedCells() const {
+    // Сдвиг на якорь сохраняет порядок, так что список остаётся отсортированным
+    std::vector<Position> result;
+    for (auto cell : program_->GetCells()) {
+        Position pos{anchor_.row + cell.row, anchor_.col + cell.col};
+        if (result.empty() || !(result.back() == pos)) {
+            result.push_back(pos);
+        }
+    }
+    return result;
+}
+
+std::vector<CellRange> CellFormula::GetReferencedRanges() const {
+    std::vector<CellRange> result;
+    for (auto range : program_->GetRanges()) {
+        result.push_back({{anchor_.row + range.first.row, anchor_.col + range.first.col},
+                          {anchor_.row + range.last.row, anchor_.col + range.last.col}});
+    }
+    return result;
+}
+
+const std::shared_ptr<const FormulaAST>& CellFormula::GetProgram() const {
+    return program_;
+}
+
+Position CellFormula::GetAnchor() const {
+    return anchor_;
+}
+
+CellFormula ParseCellFormula(std::string_view expression, Position anchor) {
+    return CellFormula(GetInternTable().GetProgram(expression, anchor), anchor);
+}
+
+size_t GetFormulaShapeCount() {
+    return GetInternTable().GetShapeCount();
+}
@@ -3,12 +3,17 @@
 #include "common.h"
 
 #include <memory>
+#include <string_view>
 #include <vector>
 
+class FormulaAST;
+
 // Формула, позволяющая вычислять и обновлять арифметическое выражение.
 // Поддерживаемые возможности:
 // * Простые бинарные операции и числа, скобки: 1+2*3, 2.5*(2+3.5/7)
 // * Значения ячеек в качестве переменных: A1+B2*C3
+// * Агрегатные функции SUM, AVERAGE, MIN, MAX, COUNT от диапазонов и
+// выражений: SUM(A1:C100), MAX(A1:A10,B1*2)
 // Ячейки, указанные в формуле, могут быть как формулами, так и текстом. Если это
 // текст, но он представляет число, тогда его нужно трактовать как число. Пустая
 // ячейка или ячейка с пустым текстом трактуется как число ноль.
@@ -34,8 +39,43 @@ public:
         // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
         // ячеек.
         virtual std::vector<Position> GetReferencedCells() const = 0;
+
+        // Возвращает диапазоны, которые используют агрегатные функции формулы.
+        // Их ячейки не входят в список GetReferencedCells().
+        virtual std::vector<CellRange> GetReferencedRanges() const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+
+// Формула, записанная в ячейке-якоре. Её скомпилированная программа хранит
+// ссылки на ячейки как смещения от якоря и разделяется всеми формулами
+// одинаковой формы: =A1*B1 в C1 и =A2*B2 в C2 используют одну программу.
+// Поэтому сама формула хранит лишь указатель на программу и позицию якоря.
+class CellFormula {
+public:
+    CellFormula(std::shared_ptr<const FormulaAST> program, Position anchor);
+
+    FormulaInterface::Value Evaluate(const SheetInterface& sheet) const;
+    std::string GetExpression() const;
+    std::vector<Position> GetReferencedCells() const;
+    std::vector<CellRange> GetReferencedRanges() const;
+
+    const std::shared_ptr<const FormulaAST>& GetProgram() const;
+    Position GetAnchor() const;
+
+private:
+    std::shared_ptr<const FormulaAST> program_;
+    Position anchor_;
+};
+
+// Парсит выражение формулы, записанной в ячейке anchor. Программы формул
+// интернируются: формула той же формы, что и уже существующая, не
+// разбирается заново, а получает её программу.
+// Бросает FormulaException в случае, если формула синтаксически некорректна.
+CellFormula ParseCellFormula(std::string_view expression, Position anchor);
+
+// Возвращает число различных форм формул, программы которых сейчас
+// используются хотя бы одной формулой.
+size_t GetFormulaShapeCount();
\ No newline at end of file
@@ -1,14 +1,27 @@
+#include "FormulaAST.h"
+#include "cell_hash_table.h"
 #include "common.h"
 #include "formula.h"
+#include "spatial_index.h"
 #include "test_runner_p.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
 #include <limits>
+#include <map>
 
 inline std::ostream& operator<<(std::ostream& output, Position pos) {
     return output << "(" << pos.row << ", " << pos.col << ")";
 }
 
-inline Position operator"" _pos(const char* str, std::size_t) {
-    return Position::FromString(str);
+inline std::ostream& operator<<(std::ostream& output, CellRange range) {
+    return output << range.first << ":" << range.last;
+}
+
+constexpr Position operator"" _pos(const char* str, std::size_t size) {
+    return Position::FromString({str, size});
 }
 
 inline std::ostream& operator<<(std::ostream& output, Size size) {
@@ -24,6 +37,15 @@ inline std::ostream& operator<<(std::ostream& output, const CellInterface::Value
     return output;
 }
 
+inline std::ostream& operator<<(std::ostream& output, const CellInterface::NumericValue& value) {
+    std::visit(
+        [&](const auto& x) {
+            output << x;
+        },
+        value);
+    return output;
+}
+
 namespace {
 // std::string ToString(FormulaError::Category category) {
 //     return std::string(FormulaError(category).ToString());
@@ -77,6 +99,27 @@ void TestStringToPositionInvalid() {
     ASSERT(!Position::FromString("ABCDEFGHIJKLMNOPQRS8").IsValid());
 }
 
+void TestPositionConstexpr() {
+    static_assert("A1"_pos == Position{0, 0});
+    static_assert("XFD16384"_pos == Position{Position::MAX_ROWS - 1, Position::MAX_COLS - 1});
+    static_assert(!"XFE1"_pos.IsValid());
+    static_assert(!"ZZZZZZZZZZZZZZZZZZZZ1"_pos.IsValid());
+    static_assert(!"A99999999999999999999"_pos.IsValid());
+    static_assert("A01"_pos == Position{0, 0});
+
+    char buffer[Position::MAX_STRING_LENGTH];
+    ASSERT_EQUAL(std::string(buffer, (Position{16383, 702}).ToChars(buffer)), std::string("AAA16384"));
+    ASSERT_EQUAL((Position{0, 0}).ToChars(buffer) - buffer, 2);
+    ASSERT(Position::NONE.ToChars(buffer) == buffer);
+
+    for (int row = 0; row < Position::MAX_ROWS; row += 97) {
+        for (int col = 0; col < Position::MAX_COLS; col += 89) {
+            Position pos{row, col};
+            ASSERT_EQUAL(Position::FromString(pos.ToString()), pos);
+        }
+    }
+}
+
 void TestEmpty() {
     auto sheet = CreateSheet();
     ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
@@ -349,6 +392,1158 @@ void TestCellCircularReferences() {
     ASSERT(caught);
     ASSERT_EQUAL(sheet->GetCell("M6"_pos)->GetText(), "Ready");
 }
+
+void TestSparseStorage() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("XFD16384"_pos, "far");
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{Position::MAX_ROWS, Position::MAX_COLS}));
+    ASSERT(sheet->GetCell("A1"_pos) == nullptr);
+    ASSERT(sheet->GetCell("XFD16383"_pos) == nullptr);
+
+    sheet->SetCell("B2"_pos, "near");
+    sheet->SetCell("B2"_pos, "nearer");
+    sheet->ClearCell("XFD16384"_pos);
+    ASSERT(sheet->GetCell("XFD16384"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 2}));
+
+    sheet->ClearCell("B2"_pos);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{0, 0}));
+}
+
+void TestCellStateTransitions() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1+2");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    sheet->SetCell("A1"_pos, "text");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(std::string("text")));
+    ASSERT(sheet->GetCell("A1"_pos)->GetReferencedCells().empty());
+
+    sheet->SetCell("A1"_pos, "");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(std::string()));
+
+    sheet->SetCell("A1"_pos, "=");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(std::string("=")));
+
+    sheet->SetCell("A1"_pos, "=B1*2");
+    sheet->SetCell("B1"_pos, "4");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(8.0));
+}
+
+void TestDependenciesRemovedOnOverwrite() {
+    auto sheet = CreateSheet();
+
+    sheet->SetCell("A1"_pos, "=B1");
+    sheet->SetCell("A1"_pos, "=C1");
+    sheet->SetCell("B1"_pos, "=A1");  // A1 больше не зависит от B1
+
+    sheet->SetCell("D1"_pos, "=E1");
+    sheet->SetCell("D1"_pos, "text");
+    sheet->SetCell("E1"_pos, "=D1");
+
+    sheet->SetCell("F1"_pos, "=G1");
+    sheet->ClearCell("F1"_pos);
+    sheet->SetCell("G1"_pos, "=F1");
+
+    bool caught = false;
+    try {
+        sheet->SetCell("C1"_pos, "=B1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+}
+
+void TestClearCellInvalidatesDependents() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1+1");
+    sheet->SetCell("B1"_pos, "2");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(3.0));
+
+    sheet->ClearCell("B1"_pos);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(1.0));
+}
+
+void TestRecalculateDiamonds() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("B1"_pos, "0");
+    // Каждая строка зависит от обеих ячеек предыдущей строки, так что число
+    // путей от A1 до последней строки растёт экспоненциально
+    const int levels = 40;
+    for (int row = 1; row <= levels; ++row) {
+        std::string prev_a = Position{row - 1, 0}.ToString();
+        std::string prev_b = Position{row - 1, 1}.ToString();
+        sheet->SetCell(Position{row, 0}, "=" + prev_a + "+" + prev_b);
+        sheet->SetCell(Position{row, 1}, "=" + prev_a + "-" + prev_b);
+    }
+
+    RecalculationReport report = sheet->Recalculate();
+    ASSERT_EQUAL(report.evaluated_cells, 2u * levels);
+    ASSERT_EQUAL(sheet->GetCell(Position{levels, 0})->GetValue(), CellInterface::Value(1048576.0));
+    ASSERT_EQUAL(sheet->Recalculate().evaluated_cells, 0u);
+
+    sheet->SetCell("A1"_pos, "2");
+    report = sheet->Recalculate();
+    ASSERT_EQUAL(report.dirty_cells, 2u * levels);
+    ASSERT_EQUAL(report.evaluated_cells, 2u * levels);
+    ASSERT_EQUAL(sheet->GetCell(Position{levels, 0})->GetValue(), CellInterface::Value(2097152.0));
+
+    // Лениво вычисленные ячейки повторно не вычисляются: остаётся только A41
+    sheet->SetCell("B1"_pos, "0");
+    sheet->GetCell(Position{levels, 1})->GetValue();
+    ASSERT_EQUAL(sheet->Recalculate().evaluated_cells, 1u);
+}
+
+void TestLongChainOrderAndCycles() {
+    auto sheet = CreateSheet();
+    const int length = 10000;
+    // Звенья цепочки A2=A1+1, A3=A2+1, ... задаются вперемешку, так что
+    // топологический порядок приходится перестраивать
+    for (int step = 0; step < length; ++step) {
+        int row = static_cast<int>((static_cast<long long>(step) * 7919) % length);
+        std::string text = row == 0 ? std::string("0") : "=" + Position{row - 1, 0}.ToString() + "+1";
+        sheet->SetCell(Position{row, 0}, text);
+    }
+
+    ASSERT_EQUAL(sheet->Recalculate().evaluated_cells, static_cast<size_t>(length - 1));
+    ASSERT_EQUAL(sheet->GetCell(Position{length - 1, 0})->GetValue(),
+                 CellInterface::Value(static_cast<double>(length - 1)));
+
+    bool caught = false;
+    try {
+        sheet->SetCell("A1"_pos, "=" + Position{length - 1, 0}.ToString());
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "0");
+
+    // Разрыв цепочки посередине позволяет замкнуть её концы
+    sheet->SetCell(Position{length / 2, 0}, "1");
+    sheet->SetCell("A1"_pos, "=" + Position{length - 1, 0}.ToString());
+    sheet->Recalculate();
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(),
+                 CellInterface::Value(static_cast<double>(length - length / 2)));
+}
+
+void TestFailedSetCellRollsBack() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1+1");
+    sheet->SetCell("B1"_pos, "=C1");
+    sheet->SetCell("C1"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    auto expect_throw = [&](Position pos, std::string text) {
+        try {
+            sheet->SetCell(pos, std::move(text));
+        } catch (const CircularDependencyException&) {
+            return;
+        } catch (const FormulaException&) {
+            return;
+        }
+        ASSERT(false);
+    };
+
+    expect_throw("B1"_pos, "=A1+C1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=C1");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetReferencedCells(), std::vector{"C1"_pos});
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(2.0));
+
+    expect_throw("B1"_pos, "=C1+");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=C1");
+
+    expect_throw("D1"_pos, "=D1");
+    ASSERT(sheet->GetCell("D1"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{1, 3}));
+
+    // Восстановленные рёбра продолжают работать
+    sheet->SetCell("C1"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetValue(), CellInterface::Value(6.0));
+}
+
+void TestSetCellsBatch() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=B1");
+    sheet->SetCell("C1"_pos, "=A1*10");
+
+    // По отдельности первая запись привела бы к циклу, но итоговое
+    // состояние пакета ациклично
+    sheet->SetCells({{"B1"_pos, "=A2+1"}, {"A2"_pos, "=D1"}, {"B1"_pos, "=A2+2"}, {"D1"_pos, "3"}});
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetText(), "=A2+2");
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(50.0));
+
+    auto expect_unchanged = [&](std::vector<std::pair<Position, std::string>> batch) {
+        try {
+            sheet->SetCells(std::move(batch));
+            ASSERT(false);
+        } catch (const CircularDependencyException&) {
+        } catch (const FormulaException&) {
+        } catch (const InvalidPositionException&) {
+        }
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetText(), "3");
+        ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetText(), "=D1");
+        ASSERT(sheet->GetCell("E5"_pos) == nullptr);
+        ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{2, 4}));
+        ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(50.0));
+    };
+    expect_unchanged({{"D1"_pos, "4"}, {"E5"_pos, "x"}, {"A2"_pos, "=C1"}});
+    expect_unchanged({{"D1"_pos, "4"}, {"E5"_pos, "x"}, {"A2"_pos, "=C1+"}});
+    expect_unchanged({{"D1"_pos, "4"}, {"E5"_pos, "x"}, {Position{-1, 0}, "1"}});
+
+    sheet->Recalculate();
+    sheet->SetCells({{"D1"_pos, "4"}, {"A1"_pos, "=B1+1"}});
+    RecalculationReport report = sheet->Recalculate();
+    ASSERT_EQUAL(report.evaluated_cells, 4u);
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(70.0));
+}
+
+void TestParallelRecalculation() {
+    auto build = [](SheetInterface& sheet) {
+        // Широкий слой независимых формул над общими входами и свёртка по нему
+        const int rows = 2000;
+        for (int row = 0; row < rows; ++row) {
+            sheet.SetCell(Position{row, 0}, std::to_string(row % 17));
+            sheet.SetCell(Position{row, 1}, "=A" + std::to_string(row + 1) + "*3-1/(A" + std::to_string(row + 1) + "-5)");
+            std::string sum = row == 0 ? "=B1" : "=C" + std::to_string(row) + "+B" + std::to_string(row + 1);
+            sheet.SetCell(Position{row, 2}, sum);
+        }
+    };
+
+    auto serial = CreateSheet();
+    auto parallel = CreateSheet();
+    parallel->SetRecalculationThreads(4);
+    build(*serial);
+    build(*parallel);
+
+    for (int round = 0; round < 3; ++round) {
+        RecalculationReport serial_report = serial->Recalculate();
+        RecalculationReport parallel_report = parallel->Recalculate();
+        ASSERT_EQUAL(parallel_report.evaluated_cells, serial_report.evaluated_cells);
+
+        std::ostringstream serial_values;
+        std::ostringstream parallel_values;
+        serial->PrintValues(serial_values);
+        parallel->PrintValues(parallel_values);
+        ASSERT_EQUAL(parallel_values.str(), serial_values.str());
+
+        serial->SetCell("A6"_pos, std::to_string(round));
+        parallel->SetCell("A6"_pos, std::to_string(round));
+    }
+}
+
+void TestDeeplyNestedFormula() {
+    // Правоассоциативная вложенность требует глубокого стека вычислений
+    const int depth = 100;
+    std::string expression = "1";
+    std::string printed = "1";
+    for (int i = 0; i < depth; ++i) {
+        expression = "2-(" + expression + ")";
+        printed = i == 0 ? "2-1" : "2-(" + printed + ")";
+    }
+    auto formula = ParseFormula(expression);
+    ASSERT_EQUAL(formula->GetExpression(), printed);
+
+    auto sheet = CreateSheet();
+    ASSERT_EQUAL(std::get<double>(formula->Evaluate(*sheet)), 1.0);
+}
+
+// Разбирает выражение заданным парсером и описывает результат строкой,
+// по которой можно сравнить два парсера: дерево, формула, ячейки и значение
+std::string DescribeParse(const std::string& expression, FormulaParserKind kind) {
+    std::ostringstream out;
+    try {
+        auto ast = kind == FormulaParserKind::Fast ? ParseFormulaASTFast(expression)
+                                                   : [&] {
+                                                         std::istringstream in(expression);
+                                                         return ParseFormulaAST(in);
+                                                     }();
+        ast.Print(out);
+        out << " | ";
+        ast.PrintFormula(out);
+        out << " | ";
+        ast.PrintCells(out);
+        out << " | ";
+        auto sheet = CreateSheet();
+        std::visit(
+            [&out](const auto& value) {
+                out << value;
+            },
+            ast.Execute(*sheet));
+    } catch (const FormulaException&) {
+        out << "FormulaException";
+    }
+    return out.str();
+}
+
+void TestFastParserMatchesAntlr() {
+    std::vector<std::string> expressions = {
+        "1",       "1.5",     ".5",       "1.",       "1e5",      "1.5E-3",    "2e+3",     "1e",
+        "1e400",   "1e-400",  "1e-99999999999", "1e99999999999", "00012",  "..5",     "A1",       "ZZ99",
+        "A0",      "a1",
+        "A1B2",    "XFD16384", "XFE1",    "A16385",   "-A1*2",    "--1",       "-+-1",     "1*-2",
+        "1 + 2",   "1\t*\n2", "(1)",      "((1+2))*3", "1-(2-3)", "1/(2*3)",   "(1",       "1)",
+        "()",      "1+",      "+",        "1 2",      "",         "1+$",       "A1 A2",    "3/0",
+        "SUM(A1:B2)", "-MAX(1,A1:A3,2*B1)", "SUM(B2:A1)", "COUNT(A1)*2", "SUM()", "SUM(A1:)", "A1:B2",
+        "FOO(1)",  "SUM",     "AVERAGE((1),(A1))", "MIN(A1:B2:C3)", "MAX(A1,,2)", "SUM(A0:A1)",
+    };
+
+    // Детерминированно сгенерированные выражения, в том числе с мусором
+    const std::string alphabet = "0123456789.eE+-*/() ABZ:,";
+    uint32_t seed = 12345;
+    auto next = [&seed](uint32_t bound) {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) % bound;
+    };
+    for (int i = 0; i < 2000; ++i) {
+        std::string expression;
+        size_t length = 1 + next(12);
+        for (size_t j = 0; j < length; ++j) {
+            expression += alphabet[next(static_cast<uint32_t>(alphabet.size()))];
+        }
+        expressions.push_back(std::move(expression));
+    }
+
+    for (const auto& expression : expressions) {
+        ASSERT_EQUAL(DescribeParse(expression, FormulaParserKind::Fast),
+                     DescribeParse(expression, FormulaParserKind::Antlr));
+    }
+}
+
+void TestFormulaShapesShared() {
+    auto sheet = CreateSheet();
+    size_t shapes_before = GetFormulaShapeCount();
+
+    // Столбец, заполненный протягиванием: одна форма на все строки
+    const int rows = 100;
+    for (int row = 0; row < rows; ++row) {
+        std::string r = std::to_string(row + 1);
+        sheet->SetCell(Position{row, 0}, r);
+        sheet->SetCell(Position{row, 1}, "2");
+        sheet->SetCell(Position{row, 2}, "=A" + r + "*B" + r);
+    }
+    ASSERT_EQUAL(GetFormulaShapeCount(), shapes_before + 1);
+    for (int row = 0; row < rows; ++row) {
+        std::string r = std::to_string(row + 1);
+        const auto* cell = sheet->GetCell(Position{row, 2});
+        ASSERT_EQUAL(cell->GetText(), "=A" + r + "*B" + r);
+        ASSERT_EQUAL(std::get<double>(cell->GetValue()), 2.0 * (row + 1));
+        ASSERT_EQUAL(cell->GetReferencedCells(), (std::vector{Position{row, 0}, Position{row, 1}}));
+    }
+
+    // Та же запись с другими абсолютными ссылками -- уже другая форма
+    sheet->SetCell("D1"_pos, "=A1*B1");
+    sheet->SetCell("D2"_pos, "=A1*B1");
+    ASSERT_EQUAL(GetFormulaShapeCount(), shapes_before + 3);
+    ASSERT_EQUAL(sheet->GetCell("D2"_pos)->GetText(), "=A1*B1");
+    ASSERT_EQUAL(std::get<double>(sheet->GetCell("D2"_pos)->GetValue()), 2.0);
+
+    // Программа освобождается вместе с последней использующей её формулой
+    for (int row = 0; row < rows; ++row) {
+        sheet->ClearCell(Position{row, 2});
+    }
+    ASSERT_EQUAL(GetFormulaShapeCount(), shapes_before + 2);
+}
+
+void TestErrorsPropagateAsValues() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "=1/0");
+    sheet->SetCell("A2"_pos, "3D");
+    sheet->SetCell("A3"_pos, "1e999");
+    sheet->SetCell("B1"_pos, "=A1+1");
+    sheet->SetCell("B2"_pos, "=A2*0");
+    sheet->SetCell("B3"_pos, "=-A3");
+    sheet->SetCell("C1"_pos, "=B2+B1");
+    sheet->SetCell("C2"_pos, "=1e200*1e200/1e300");
+
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet->GetCell("B3"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    // Возвращается первая встреченная при вычислении ошибка
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Value));
+    // Переполнение промежуточного результата -- ошибка, даже если итог конечен
+    ASSERT_EQUAL(sheet->GetCell("C2"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+
+    std::ostringstream values;
+    sheet->PrintValues(values);
+    ASSERT_EQUAL(values.str(), "#DIV/0!\t#DIV/0!\t#VALUE!\n3D\t#VALUE!\t#DIV/0!\n1e999\t#VALUE!\t\n");
+}
+
+void TestNumericTextCells() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "42");
+    sheet->SetCell("A2"_pos, "'-1.5e1");
+    sheet->SetCell("A3"_pos, "'");
+    sheet->SetCell("A4"_pos, " 7");
+    sheet->SetCell("A5"_pos, "nan");
+
+    using NumericValue = CellInterface::NumericValue;
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetNumericValue(), NumericValue(42.0));
+    ASSERT_EQUAL(sheet->GetCell("A2"_pos)->GetNumericValue(), NumericValue(-15.0));
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetNumericValue(), NumericValue(0.0));
+    ASSERT_EQUAL(sheet->GetCell("A4"_pos)->GetNumericValue(), NumericValue(FormulaError::Category::Value));
+    ASSERT_EQUAL(sheet->GetCell("A5"_pos)->GetNumericValue(), NumericValue(FormulaError::Category::Value));
+
+    sheet->SetCell("B1"_pos, "=A1+A2+A3");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetNumericValue(), NumericValue(27.0));
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetValue(), CellInterface::Value(27.0));
+
+    // Перезапись текста меняет и его числовую трактовку
+    sheet->SetCell("A1"_pos, "x");
+    ASSERT_EQUAL(sheet->GetCell("B1"_pos)->GetNumericValue(), NumericValue(FormulaError::Category::Value));
+}
+
+void TestRangeAggregates() {
+    auto sheet = CreateSheet();
+    sheet->SetCell("A1"_pos, "1");
+    sheet->SetCell("A2"_pos, "=A1*4");
+    sheet->SetCell("A3"_pos, "'7");
+    sheet->SetCell("A4"_pos, "text");
+    sheet->SetCell("A5"_pos, "'");
+    sheet->SetCell("B1"_pos, "-2");
+
+    auto value = [&sheet](std::string expression) {
+        sheet->SetCell("D1"_pos, "=" + expression);
+        return sheet->GetCell("D1"_pos)->GetValue();
+    };
+    // Пустые ячейки и нечисловой текст пропускаются, числовой текст учитывается
+    ASSERT_EQUAL(value("SUM(A1:B6)"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(value("COUNT(A1:B6)"), CellInterface::Value(4.0));
+    ASSERT_EQUAL(value("AVERAGE(A1:B6)"), CellInterface::Value(2.5));
+    ASSERT_EQUAL(value("MIN(A1:B6)"), CellInterface::Value(-2.0));
+    ASSERT_EQUAL(value("MAX(B6:A1)"), CellInterface::Value(7.0));
+    ASSERT_EQUAL(value("MAX(A1:A2,10,B1*-8)+1"), CellInterface::Value(17.0));
+    ASSERT_EQUAL(value("SUM(A1,SUM(A1:A2,1))"), CellInterface::Value(7.0));
+    ASSERT_EQUAL(value("MIN(C1:C9)"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("COUNT(C1:C9)"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("AVERAGE(C1:C9)"), CellInterface::Value(FormulaError::Category::Div0));
+
+    // Ячейка-аргумент учитывается так же, как диапазон из одной ячейки
+    ASSERT_EQUAL(value("COUNT(C1)"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("COUNT(C1:C1)"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("COUNT(A4)"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("COUNT(A4:A4)"), CellInterface::Value(0.0));
+    ASSERT_EQUAL(value("SUM(A4,A1)"), CellInterface::Value(1.0));
+    ASSERT_EQUAL(value("MIN(A4,C1,A3)"), CellInterface::Value(7.0));
+    ASSERT_EQUAL(value("COUNT(A1,A3,A5)"), CellInterface::Value(2.0));
+    ASSERT_EQUAL(value("COUNT(A4+0)"), CellInterface::Value(FormulaError::Category::Value));
+    ASSERT_EQUAL(value("COUNT(C1+0)"), CellInterface::Value(1.0));
+    sheet->SetCell("D1"_pos, "=COUNT(A1,B1:B2)");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetText(), "=COUNT(A1,B1:B2)");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+
+    // Диапазон записывается от левого верхнего угла к правому нижнему
+    sheet->SetCell("D1"_pos, "=-SUM(B6:A1 , 2*(1+A1))/COUNT(A1)");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetText(), "=-SUM(A1:B6,2*(1+A1))/COUNT(A1)");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetReferencedCells(), std::vector{"A1"_pos});
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetReferencedRanges(),
+                 (std::vector{CellRange{"A1"_pos, "B6"_pos}}));
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(-14.0));
+
+    // Изменение ячейки диапазона сбрасывает кэш формулы, ошибка в диапазоне
+    // становится значением формулы
+    sheet->SetCell("B3"_pos, "=1/0");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    sheet->ClearCell("B3"_pos);
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(-14.0));
+
+    // Диапазон, содержащий саму ячейку, образует цикл
+    bool caught = false;
+    try {
+        sheet->SetCell("B2"_pos, "=SUM(A1:B6)");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(sheet->GetCell("B2"_pos) == nullptr);
+
+    for (auto expression : {"A1:B2", "SUM()", "SUM(A1:B2", "SUM A1", "FOO(A1)", "SUM(A1:2)", "SUM(A1:B0)",
+                            "SUM(1:A1)", "sum(A1)", "SUM(A1:B2:C3)", "SUM(A1,)", "(A1:B2)"}) {
+        caught = false;
+        try {
+            sheet->SetCell("E1"_pos, std::string("=") + expression);
+        } catch (const FormulaException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+}
+
+void TestRangeScansFollowEdits() {
+    // Столбец A заполняется числами, числовым и обычным текстом и формулами
+    // от C1 вокруг границ машинных слов и сегментов теневого хранилища.
+    // После правок SUM и COUNT сверяются с моделью.
+    auto sheet = CreateSheet();
+    const int rows = 2200;
+    std::vector<double> numbers(rows);
+    std::vector<double> factors(rows);
+    std::vector<bool> present(rows);
+    double c1 = 1;
+    sheet->SetCell("C1"_pos, "1");
+    sheet->SetCell("D1"_pos, "=SUM(A1:A2200)");
+    sheet->SetCell("D2"_pos, "=COUNT(A2:A2200)");
+
+    uint32_t seed = 2024;
+    auto next = [&seed](uint32_t bound) {
+        seed = seed * 1103515245u + 12345u;
+        return (seed >> 16) % bound;
+    };
+    const int hot_rows[] = {0, 1, 62, 63, 64, 65, 127, 128, 1022, 1023, 1024, 1025, 2047, 2048, 2199};
+    const uint32_t hot_row_count = sizeof(hot_rows) / sizeof(hot_rows[0]);
+    for (int step = 0; step < 3000; ++step) {
+        int row = step % 2 ? hot_rows[next(hot_row_count)] : static_cast<int>(next(rows));
+        Position pos{row, 0};
+        int value = static_cast<int>(next(100)) - 50;
+        switch (next(7)) {
+            case 0:
+                sheet->SetCell(pos, std::to_string(value));
+                numbers[row] = value, factors[row] = 0, present[row] = true;
+                break;
+            case 1:
+                sheet->SetCell(pos, "'" + std::to_string(value));
+                numbers[row] = value, factors[row] = 0, present[row] = true;
+                break;
+            case 2:
+                sheet->SetCell(pos, "x" + std::to_string(value));
+                present[row] = false;
+                break;
+            case 3:
+                sheet->SetCell(pos, "=C1*" + std::to_string(value + 100));
+                numbers[row] = 0, factors[row] = value + 100, present[row] = true;
+                break;
+            case 4:
+                sheet->ClearCell(pos);
+                present[row] = false;
+                break;
+            case 5:
+                c1 = value;
+                sheet->SetCell("C1"_pos, std::to_string(value));
+                break;
+            default:
+                sheet->Recalculate();
+                break;
+        }
+        if (step % 10 != 0) {
+            continue;
+        }
+        double sum = 0;
+        double count = 0;
+        for (int i = 0; i < rows; ++i) {
+            if (present[i]) {
+                sum += numbers[i] + factors[i] * c1;
+                count += i > 0;
+            }
+        }
+        ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(sum));
+        ASSERT_EQUAL(sheet->GetCell("D2"_pos)->GetValue(), CellInterface::Value(count));
+    }
+
+    // Ошибка формулы внутри диапазона становится значением агрегата
+    sheet->SetCell("A1500"_pos, "=1/0");
+    sheet->Recalculate();
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(FormulaError::Category::Div0));
+    sheet->SetCell("A1500"_pos, "=C1-C1");
+    ASSERT(std::holds_alternative<double>(sheet->GetCell("D1"_pos)->GetValue()));
+}
+
+void TestRangeDependencies() {
+    auto sheet = CreateSheet();
+    // Диапазон во весь столбец хранится одним ребром
+    sheet->SetCell("D1"_pos, "=SUM(A1:A16384)");
+    sheet->SetCell("A16384"_pos, "5");
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(5.0));
+
+    // Цикл через диапазон и промежуточную формулу
+    sheet->SetCell("D2"_pos, "=D1*2");
+    bool caught = false;
+    try {
+        sheet->SetCell("A3"_pos, "=D2");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT(sheet->GetCell("A3"_pos) == nullptr);
+    ASSERT_EQUAL(sheet->GetCell("D2"_pos)->GetValue(), CellInterface::Value(10.0));
+
+    // Ячейка, на которую формула ссылается и напрямую, и через пересекающиеся
+    // диапазоны, учитывается в каждом из них
+    sheet->SetCell("E1"_pos, "=A2+SUM(A1:A3)+SUM(A2:A5)");
+    sheet->SetCell("A2"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(3.0));
+    sheet->ClearCell("A2"_pos);
+    ASSERT_EQUAL(sheet->GetCell("E1"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // A(i) = SUM(A1:A(i-1)) задаются вперемешку, так что порядок вычисления
+    // многократно перестраивается. Последовательный и параллельный пересчёт
+    // должны дать одно и то же
+    const int rows = 200;
+    auto build = [](SheetInterface& sheet) {
+        for (int i = 0; i < rows - 1; ++i) {
+            int row = (i * 37) % (rows - 1) + 1;
+            sheet.SetCell(Position{row, 0}, "=SUM(A1:A" + std::to_string(row) + ")");
+        }
+        sheet.SetCell("A1"_pos, "1");
+    };
+    auto serial = CreateSheet();
+    auto parallel = CreateSheet();
+    parallel->SetRecalculationThreads(4);
+    build(*serial);
+    build(*parallel);
+    for (int round = 0; round < 2; ++round) {
+        ASSERT_EQUAL(parallel->Recalculate().evaluated_cells, serial->Recalculate().evaluated_cells);
+        std::ostringstream serial_values;
+        std::ostringstream parallel_values;
+        serial->PrintValues(serial_values);
+        parallel->PrintValues(parallel_values);
+        ASSERT_EQUAL(parallel_values.str(), serial_values.str());
+        ASSERT_EQUAL(serial->GetCell(Position{rows - 1, 0})->GetValue(),
+                     CellInterface::Value(std::ldexp(1.0 + round, rows - 2)));
+
+        serial->SetCell("A1"_pos, "2");
+        parallel->SetCell("A1"_pos, "2");
+    }
+}
+
+void TestPrintMatchesStreamFormatting() {
+    auto sheet = CreateSheet();
+    const char* texts[] = {"text", "'=escaped", "'", "=1/3", "=1/0", "=A1", "=-2/3*1e-7", "=123456789",
+                           "=0.1+0.2", "=1e21", "=-0.5", "=SUM(Z1:Z9)", "=D1+1e100", "12.50"};
+    int index = 0;
+    // Разрывы шире блока хранилища и пустые строки между ячейками
+    for (int row : {0, 1, 5, 70}) {
+        for (int col : {0, 3, 31, 32, 33, 100}) {
+            sheet->SetCell(Position{row, col}, texts[index++ % std::size(texts)]);
+        }
+    }
+    sheet->SetCell("CZ90"_pos, "=AZ80");
+    sheet->SetCell("CZ90"_pos, "");
+
+    // Вывод должен совпадать с поячеечной печатью через operator<< при
+    // любом формате потока
+    auto reference = [&sheet](std::ostream& output, bool values) {
+        Size size = sheet->GetPrintableSize();
+        for (int row = 0; row < size.rows; ++row) {
+            for (int col = 0; col < size.cols; ++col) {
+                if (col > 0) {
+                    output << '\t';
+                }
+                if (const CellInterface* cell = sheet->GetCell({row, col})) {
+                    if (values) {
+                        output << cell->GetValue();
+                    } else {
+                        output << cell->GetText();
+                    }
+                }
+            }
+            output << '\n';
+        }
+    };
+    std::vector<std::function<void(std::ostream&)>> formats = {
+        [](std::ostream&) {},
+        [](std::ostream& output) { output.precision(17); },
+        [](std::ostream& output) { output.precision(0); },
+        [](std::ostream& output) { output << std::fixed; },
+        [](std::ostream& output) { output << std::scientific << std::uppercase << std::showpos; },
+    };
+    for (const auto& format : formats) {
+        for (bool values : {true, false}) {
+            std::ostringstream expected;
+            std::ostringstream actual;
+            format(expected);
+            format(actual);
+            reference(expected, values);
+            if (values) {
+                sheet->PrintValues(actual);
+            } else {
+                sheet->PrintTexts(actual);
+            }
+            ASSERT_EQUAL(actual.str(), expected.str());
+        }
+    }
+}
+
+void TestSnapshotRoundTrip() {
+    auto sheet = CreateSheet();
+    sheet->SetCells({{"A1"_pos, "1"},           {"A2"_pos, "'2"},           {"A3"_pos, "text"},
+                     {"A4"_pos, "'=escaped"},   {"B1"_pos, "=A1*10"},       {"B2"_pos, "=A2*10"},
+                     {"B3"_pos, "=A3*10"},      {"C1"_pos, "=SUM(A1:B9)"},  {"C2"_pos, "=C1/E9"},
+                     {"D5"_pos, "=AVERAGE(B1:B2)+F7"}, {"AZ100"_pos, "far"}});
+    sheet->Recalculate();
+    // Часть значений устаревает и в снимок не попадает
+    sheet->SetCell("A1"_pos, "3");
+
+    auto print = [](const SheetInterface& sheet) {
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        sheet.PrintValues(output);
+        return output.str();
+    };
+    auto save = [](const SheetInterface& sheet) {
+        std::ostringstream output(std::ios::binary);
+        sheet.SaveSnapshot(output);
+        return output.str();
+    };
+    std::string snapshot = save(*sheet);
+    auto loaded = LoadSnapshotFromMemory(snapshot);
+    ASSERT_EQUAL(loaded->GetPrintableSize(), sheet->GetPrintableSize());
+    ASSERT(loaded->GetCell("F7"_pos) != nullptr);
+    ASSERT_EQUAL(loaded->GetCell("D5"_pos)->GetReferencedRanges(), (std::vector{CellRange{"B1"_pos, "B2"_pos}}));
+    ASSERT_EQUAL(print(*loaded), print(*sheet));
+    ASSERT_EQUAL(save(*loaded), save(*sheet));
+
+    // Восстановленный граф сбрасывает кэши и находит циклы
+    loaded->SetCell("A2"_pos, "5");
+    sheet->SetCell("A2"_pos, "5");
+    ASSERT_EQUAL(print(*loaded), print(*sheet));
+    bool caught = false;
+    try {
+        loaded->SetCell("A5"_pos, "=C1");
+    } catch (const CircularDependencyException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+
+    // Загрузка через отображение файла в память
+    std::string path = "spreadsheet_snapshot_test.bin";
+    {
+        std::ofstream output(path, std::ios::binary);
+        sheet->SaveSnapshot(output);
+    }
+    auto mapped = LoadSnapshot(path);
+    std::remove(path.c_str());
+    ASSERT_EQUAL(print(*mapped), print(*sheet));
+
+    // Повреждённый снимок либо отвергается, либо даёт корректную таблицу.
+    // Сохранённым значениям снимок верит, но после изменения A1 каждая
+    // зависящая от неё формула должна совпадать с вычислением заново по
+    // значениям своих аргументов
+    snapshot = save(*sheet);
+    const Size area = sheet->GetPrintableSize();
+    auto check_after_edit = [area](SheetInterface& damaged) {
+        std::vector<Position> formulas;
+        for (int row = 0; row < area.rows; ++row) {
+            for (int col = 0; col < area.cols; ++col) {
+                const CellInterface* cell = damaged.GetCell({row, col});
+                if (cell && cell->GetText().size() > 1 && cell->GetText()[0] == FORMULA_SIGN) {
+                    formulas.push_back({row, col});
+                }
+            }
+        }
+        std::vector<Position> affected = {"A1"_pos};
+        auto is_affected = [&affected](Position pos) {
+            return std::find(affected.begin(), affected.end(), pos) != affected.end();
+        };
+        for (bool changed = true; changed;) {
+            changed = false;
+            for (Position pos : formulas) {
+                const CellInterface* cell = damaged.GetCell(pos);
+                bool depends = false;
+                for (Position referenced : cell->GetReferencedCells()) {
+                    depends = depends || is_affected(referenced);
+                }
+                for (CellRange range : cell->GetReferencedRanges()) {
+                    for (Position other : affected) {
+                        depends = depends || (range.first.row <= other.row && other.row <= range.last.row
+                                              && range.first.col <= other.col && other.col <= range.last.col);
+                    }
+                }
+                if (depends && !is_affected(pos)) {
+                    affected.push_back(pos);
+                    changed = true;
+                }
+            }
+        }
+
+        damaged.SetCell("A1"_pos, "5");
+        for (Position pos : affected) {
+            const CellInterface* cell = damaged.GetCell(pos);
+            if (pos == "A1"_pos) {
+                continue;
+            }
+            CellInterface::Value value = cell->GetValue();
+            auto expected = ParseFormula(cell->GetText().substr(1))->Evaluate(damaged);
+            // Текст формулы печатает числа с ограниченной точностью, так что
+            // повреждённая константа программы разбирается из него неточно
+            if (const double* number = std::get_if<double>(&expected)) {
+                ASSERT(std::holds_alternative<double>(value));
+                ASSERT(std::abs(std::get<double>(value) - *number) <= 1e-5 * std::max(1.0, std::abs(*number)));
+            }
+            else {
+                ASSERT_EQUAL(value, CellInterface::Value(std::get<FormulaError>(expected)));
+            }
+        }
+    };
+    size_t loaded_count = 0;
+    for (size_t i = 0; i < snapshot.size(); ++i) {
+        for (char mask : {'\x01', '\x80', '\xff'}) {
+            std::string corrupted = snapshot;
+            corrupted[i] ^= mask;
+            std::unique_ptr<SheetInterface> damaged;
+            try {
+                damaged = LoadSnapshotFromMemory(corrupted);
+            } catch (const SnapshotException&) {
+                continue;
+            }
+            ++loaded_count;
+            check_after_edit(*damaged);
+            damaged->Recalculate();
+            std::ostringstream output;
+            damaged->PrintValues(output);
+        }
+    }
+    ASSERT(loaded_count > 0);
+    for (size_t size : {size_t{0}, size_t{7}, snapshot.size() - 1}) {
+        caught = false;
+        try {
+            LoadSnapshotFromMemory(std::string_view(snapshot).substr(0, size));
+        } catch (const SnapshotException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+    }
+}
+
+void TestImportTable() {
+    auto print_texts = [](const SheetInterface& sheet) {
+        std::ostringstream output;
+        sheet.PrintTexts(output);
+        return output.str();
+    };
+
+    // TSV совпадает с выводом PrintTexts()
+    auto source = CreateSheet();
+    source->SetCells({{"A1"_pos, "1"},      {"C1"_pos, "=A1+B2"},       {"B2"_pos, "2"},
+                      {"A3"_pos, "=C1*2"},  {"D3"_pos, "=SUM(A1:C2)"},  {"B5"_pos, "'=text"}});
+    std::istringstream tsv(print_texts(*source));
+    auto sheet = CreateSheet();
+    sheet->ImportTable(tsv, TableFormat::Tsv);
+    ASSERT_EQUAL(print_texts(*sheet), print_texts(*source));
+    ASSERT_EQUAL(sheet->GetPrintableSize(), (Size{5, 4}));
+    ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(6.0));
+    ASSERT_EQUAL(sheet->GetCell("B5"_pos)->GetValue(), CellInterface::Value("=text"));
+
+    // Импорт поверх таблицы: пустое поле очищает ячейку, зависимые формулы
+    // пересчитываются
+    std::istringstream update("5\t\t\n\t=A1*3\n");
+    sheet->ImportTable(update, TableFormat::Tsv);
+    ASSERT_EQUAL(sheet->GetCell("C1"_pos)->GetText(), "");
+    ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(15.0));
+    ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetValue(), CellInterface::Value(20.0));
+    ASSERT_EQUAL(sheet->GetCell("A3"_pos)->GetValue(), CellInterface::Value(0.0));
+
+    // Кавычки CSV, "\r\n" и поле длиннее блока чтения
+    std::string long_text(100000, 'x');
+    std::istringstream csv(std::string("\"a,b\",\"say \"\"hi\"\"\"\r\n\"multi\nline\",=1+1,\"\"\r\n") + long_text + ",tail");
+    auto csv_sheet = CreateSheet();
+    csv_sheet->ImportTable(csv, TableFormat::Csv);
+    ASSERT_EQUAL(csv_sheet->GetPrintableSize(), (Size{3, 2}));
+    ASSERT_EQUAL(csv_sheet->GetCell("A1"_pos)->GetText(), "a,b");
+    ASSERT_EQUAL(csv_sheet->GetCell("B1"_pos)->GetText(), "say \"hi\"");
+    ASSERT_EQUAL(csv_sheet->GetCell("A2"_pos)->GetText(), "multi\nline");
+    ASSERT_EQUAL(csv_sheet->GetCell("B2"_pos)->GetValue(), CellInterface::Value(2.0));
+    ASSERT(csv_sheet->GetCell("C2"_pos) == nullptr);
+    ASSERT_EQUAL(csv_sheet->GetCell("A3"_pos)->GetText(), long_text);
+    ASSERT_EQUAL(csv_sheet->GetCell("B3"_pos)->GetText(), "tail");
+
+    // Цикл, в том числе через уже существующие формулы, обнаруживается после
+    // чтения всего входа, и таблица не меняется
+    std::string before = print_texts(*sheet);
+    for (const char* text : {"=B1\t=A1\n", "\t=D3\n", "=A1\n"}) {
+        std::istringstream cyclic(text);
+        bool caught = false;
+        try {
+            sheet->ImportTable(cyclic, TableFormat::Tsv);
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(print_texts(*sheet), before);
+    }
+    ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetValue(), CellInterface::Value(20.0));
+    sheet->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(sheet->GetCell("D3"_pos)->GetValue(), CellInterface::Value(4.0));
+
+    // Импорт в заполненную таблицу: небольшой вход добавляет рёбра по одному,
+    // а сравнимый с графом строит порядок заново. Цепочка D1..D{N} не
+    // затрагивается полями столбцов A и B
+    const int chain_length = 2000;
+    auto chained = CreateSheet();
+    std::vector<std::pair<Position, std::string>> chain = {{{0, 3}, "1"}};
+    for (int row = 1; row < chain_length; ++row) {
+        chain.push_back({{row, 3}, "=D" + std::to_string(row) + "+1"});
+    }
+    chained->SetCells(chain);
+    auto import_into_chain = [&chained](const std::string& text) {
+        std::istringstream input(text);
+        chained->ResetStats();
+        chained->ImportTable(input, TableFormat::Tsv);
+        return chained->GetStats().cycle_check_visits;
+    };
+    auto import_cycle_into_chain = [&chained, &print_texts](const std::string& text) {
+        std::string before = print_texts(*chained);
+        std::istringstream input(text);
+        bool caught = false;
+        try {
+            chained->ImportTable(input, TableFormat::Tsv);
+        } catch (const CircularDependencyException&) {
+            caught = true;
+        }
+        ASSERT(caught);
+        ASSERT_EQUAL(print_texts(*chained), before);
+    };
+    const std::string last = "D" + std::to_string(chain_length);
+
+    ASSERT_EQUAL(import_into_chain(""), 0u);
+    ASSERT(import_into_chain("=" + last + "*2\n") < static_cast<uint64_t>(chain_length));
+    ASSERT_EQUAL(chained->GetCell("A1"_pos)->GetValue(), CellInterface::Value(4000.0));
+    import_cycle_into_chain("=" + last + "*2\t\t\t=A1\n");
+
+    std::string table;
+    for (int row = 1; row <= chain_length; ++row) {
+        table += "=D" + std::to_string(row) + "*2\t=A" + std::to_string(row) + "+1\n";
+    }
+    ASSERT(import_into_chain(table) >= static_cast<uint64_t>(chain_length));
+    // Цикл замыкается через D1 в первой строке входа
+    std::string cyclic_table = table;
+    cyclic_table.insert(cyclic_table.find('\n'), "\t\t=B" + std::to_string(chain_length));
+    import_cycle_into_chain(cyclic_table);
+    chained->SetCell("D1"_pos, "5");
+    ASSERT_EQUAL(chained->GetCell(Position::FromString("B" + std::to_string(chain_length)))->GetValue(),
+                 CellInterface::Value(4009.0));
+    ASSERT_EQUAL(chained->GetCell("B1"_pos)->GetValue(), CellInterface::Value(11.0));
+
+    std::istringstream incorrect("1\t=1+\n");
+    bool caught = false;
+    try {
+        sheet->ImportTable(incorrect, TableFormat::Tsv);
+    } catch (const FormulaException&) {
+        caught = true;
+    }
+    ASSERT(caught);
+    ASSERT_EQUAL(sheet->GetCell("A1"_pos)->GetText(), "1");
+}
+
+void TestCalculationPolicies() {
+    auto value = [](const SheetInterface& sheet, std::string_view pos) {
+        return sheet.GetCell(Position::FromString(pos))->GetValue();
+    };
+    auto make_sheet = []() {
+        auto sheet = CreateSheet();
+        sheet->SetCells({{"A1"_pos, "1"}, {"B1"_pos, "=A1*10"}, {"C1"_pos, "=SUM(A1:B1)"}, {"D1"_pos, "=C1+1"}});
+        sheet->Recalculate();
+        return sheet;
+    };
+
+    // Lazy: запись только сбрасывает кэши
+    auto lazy = make_sheet();
+    ASSERT(lazy->GetCalculationPolicy() == CalculationPolicy::Lazy);
+    lazy->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(lazy->Recalculate().evaluated_cells, 3u);
+    ASSERT_EQUAL(value(*lazy, "D1"), CellInterface::Value(23.0));
+
+    // Eager: к чтению всё уже вычислено
+    auto eager = make_sheet();
+    eager->SetCell("A1"_pos, "5");
+    eager->SetCalculationPolicy(CalculationPolicy::Eager);
+    ASSERT_EQUAL(eager->Recalculate().evaluated_cells, 0u);
+    eager->SetCells({{"A1"_pos, "2"}, {"E1"_pos, "=D1*2"}});
+    ASSERT_EQUAL(eager->Recalculate().evaluated_cells, 0u);
+    ASSERT_EQUAL(value(*eager, "E1"), CellInterface::Value(46.0));
+    eager->ClearCell("B1"_pos);
+    ASSERT_EQUAL(eager->Recalculate().evaluated_cells, 0u);
+    ASSERT_EQUAL(value(*eager, "E1"), CellInterface::Value(6.0));
+
+    // Manual: зависимые формулы и диапазоны хранят прежние значения до
+    // Recalculate(), новая формула считается по ним
+    auto manual = make_sheet();
+    manual->SetCalculationPolicy(CalculationPolicy::Manual);
+    manual->SetCell("A1"_pos, "2");
+    ASSERT_EQUAL(value(*manual, "A1"), CellInterface::Value(std::string("2")));
+    ASSERT_EQUAL(value(*manual, "B1"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(value(*manual, "D1"), CellInterface::Value(12.0));
+    manual->SetCell("E1"_pos, "=SUM(A1:B1)+D1");
+    ASSERT_EQUAL(value(*manual, "E1"), CellInterface::Value(24.0));
+    std::ostringstream snapshot;
+    manual->SaveSnapshot(snapshot);
+    manual->SetCell("A1"_pos, "3");
+    ASSERT_EQUAL(value(*manual, "B1"), CellInterface::Value(10.0));
+    ASSERT_EQUAL(manual->Recalculate().evaluated_cells, 4u);
+    ASSERT_EQUAL(value(*manual, "D1"), CellInterface::Value(34.0));
+    ASSERT_EQUAL(value(*manual, "E1"), CellInterface::Value(67.0));
+
+    // Снимок не сохраняет прежние значения
+    auto loaded = LoadSnapshotFromMemory(snapshot.str());
+    ASSERT_EQUAL(value(*loaded, "D1"), CellInterface::Value(23.0));
+    ASSERT_EQUAL(value(*loaded, "E1"), CellInterface::Value(45.0));
+
+    // Выход из Manual сбрасывает прежние значения
+    manual->SetCell("A1"_pos, "1");
+    ASSERT_EQUAL(value(*manual, "D1"), CellInterface::Value(34.0));
+    manual->SetCalculationPolicy(CalculationPolicy::Lazy);
+    ASSERT_EQUAL(value(*manual, "D1"), CellInterface::Value(12.0));
+    manual->SetCalculationPolicy(CalculationPolicy::Manual);
+    manual->SetCell("A1"_pos, "4");
+    manual->SetCalculationPolicy(CalculationPolicy::Eager);
+    ASSERT_EQUAL(manual->Recalculate().evaluated_cells, 0u);
+    ASSERT_EQUAL(value(*manual, "E1"), CellInterface::Value(89.0));
+}
+
+void TestSheetStats() {
+    auto sheet = CreateSheet();
+    sheet->SetCells({{"A1"_pos, "1"}, {"B1"_pos, "=A1*2"}, {"C1"_pos, "=B1+1"}, {"D1"_pos, "=SUM(A1:C1)"}});
+    SheetStats stats = sheet->GetStats();
+    ASSERT_EQUAL(stats.formulas_parsed, 3u);
+    ASSERT(stats.parse_nanoseconds > 0);
+    ASSERT_EQUAL(stats.invalidations, 1u);
+    ASSERT_EQUAL(stats.invalidated_cells, 3u);
+    ASSERT(stats.cell_bytes > 0 && stats.formula_program_bytes > 0 && stats.dependency_graph_bytes > 0);
+
+    sheet->ResetStats();
+    stats = sheet->GetStats();
+    ASSERT_EQUAL(stats.formula_evaluations + stats.cache_hits + stats.invalidations + stats.formulas_parsed, 0u);
+
+    sheet->Recalculate();
+    stats = sheet->GetStats();
+    ASSERT_EQUAL(stats.formula_evaluations, 3u);
+    sheet->GetCell("C1"_pos)->GetValue();
+    sheet->GetCell("D1"_pos)->GetValue();
+    ASSERT_EQUAL(sheet->GetStats().cache_hits, stats.cache_hits + 2);
+    ASSERT_EQUAL(sheet->GetStats().formula_evaluations, 3u);
+
+    // Изменение сбрасывает кэш всех транзитивно зависимых формул
+    sheet->SetCell("A1"_pos, "2");
+    stats = sheet->GetStats();
+    ASSERT_EQUAL(stats.invalidations, 1u);
+    ASSERT_EQUAL(stats.invalidated_cells, 3u);
+    ASSERT_EQUAL(sheet->GetCell("D1"_pos)->GetValue(), CellInterface::Value(11.0));
+    ASSERT_EQUAL(sheet->GetStats().formula_evaluations, 6u);
+
+    // Поиск цикла просматривает вершины графа
+    ASSERT_EQUAL(stats.cycle_check_visits, 0u);
+    try {
+        sheet->SetCell("A1"_pos, "=D1");
+    } catch (const CircularDependencyException&) {
+    }
+    ASSERT(sheet->GetStats().cycle_check_visits > 0);
+
+    // Формулы одной формы делят программу
+    size_t program_bytes = sheet->GetStats().formula_program_bytes;
+    for (int row = 1; row < 100; ++row) {
+        sheet->SetCell(Position{row, 1}, "=" + Position{row, 0}.ToString() + "*2");
+    }
+    ASSERT_EQUAL(sheet->GetStats().formula_program_bytes, program_bytes);
+    ASSERT_EQUAL(sheet->GetStats().formulas_parsed, 100u);
+}
+
+void TestCellHashTable() {
+    // Вставки вперемешку с удалениями оставляют в таблице удалённые места
+    // и несколько раз перестраивают её
+    CellMap<int> map;
+    std::map<Position, int> expected;
+    uint32_t state = 1;
+    for (int i = 0; i < 20000; ++i) {
+        state = state * 1664525 + 1013904223;
+        Position pos{static_cast<int>(state >> 24) % 64, static_cast<int>(state >> 8) % 64};
+        if ((state >> 16) % 3 == 0) {
+            ASSERT_EQUAL(map.erase(pos), expected.erase(pos));
+        }
+        else {
+            map[pos] = i;
+            expected[pos] = i;
+        }
+    }
+    ASSERT_EQUAL(map.size(), expected.size());
+    for (const auto& [key, value] : map) {
+        auto it = expected.find(key);
+        ASSERT(it != expected.end());
+        ASSERT_EQUAL(it->second, value);
+    }
+    for (const auto& [pos, value] : expected) {
+        ASSERT_EQUAL(map.at(pos), value);
+    }
+    map.clear();
+    ASSERT(map.empty());
+    ASSERT(map.begin() == map.end());
+    ASSERT(map.find("A1"_pos) == map.end());
+
+    CellSet set = {"A1"_pos, "XFD16384"_pos};
+    ASSERT(!set.insert("A1"_pos).second);
+    ASSERT_EQUAL(set.count("XFD16384"_pos), 1u);
+    ASSERT_EQUAL(Position(*set.find("XFD16384"_pos)), "XFD16384"_pos);
+    CellSet copy = set;
+    set.erase("A1"_pos);
+    ASSERT_EQUAL(set.size(), 1u);
+    ASSERT_EQUAL(copy.size(), 2u);
+    ASSERT_EQUAL(copy.count("A1"_pos), 1u);
+}
+
+void TestRangeIndex() {
+    // Случайные диапазоны разных размеров, повторяющиеся пары и нарастающие
+    // итоги вида A1:A{n} сверяются с полным перебором
+    RangeIndex index;
+    std::vector<std::pair<CellRange, Position>> ranges;
+    auto check = [&](Position pos) {
+        std::vector<Position> expected;
+        for (const auto& [range, owner] : ranges) {
+            if (range.first.row <= pos.row && pos.row <= range.last.row && range.first.col <= pos.col
+                && pos.col <= range.last.col) {
+                expected.push_back(owner);
+            }
+        }
+        std::vector<Position> owners;
+        index.ForEachOwner(pos, [&owners](Position owner) {
+            owners.push_back(owner);
+        });
+        std::sort(expected.begin(), expected.end());
+        std::sort(owners.begin(), owners.end());
+        ASSERT_EQUAL(owners, expected);
+        ASSERT_EQUAL(index.IsCovered(pos), !expected.empty());
+    };
+
+    for (int row = 0; row < 200; ++row) {
+        ranges.push_back({{{0, 0}, {row, 0}}, {row, 1}});
+        index.Add(ranges.back().first, ranges.back().second);
+    }
+    uint32_t state = 1;
+    auto next = [&state](int bound) {
+        state = state * 1664525 + 1013904223;
+        return static_cast<int>(state >> 8) % bound;
+    };
+    for (int i = 0; i < 3000; ++i) {
+        if (!ranges.empty() && next(3) == 0) {
+            size_t index_to_remove = next(static_cast<int>(ranges.size()));
+            index.Remove(ranges[index_to_remove].first, ranges[index_to_remove].second);
+            ranges.erase(ranges.begin() + index_to_remove);
+        }
+        else if (!ranges.empty() && next(8) == 0) {
+            ranges.push_back(ranges[next(static_cast<int>(ranges.size()))]);
+            index.Add(ranges.back().first, ranges.back().second);
+        }
+        else {
+            int size = next(4) == 0 ? 300 : 8;
+            Position first{next(260), next(260)};
+            Position last{first.row + next(size), first.col + next(size)};
+            ranges.push_back({{first, last}, {next(100), next(100)}});
+            index.Add(ranges.back().first, ranges.back().second);
+        }
+        check({next(600), next(600)});
+    }
+    ASSERT_EQUAL(index.GetRangeCount(), ranges.size());
+    for (int row = 0; row < 600; row += 7) {
+        for (int col = 0; col < 600; col += 11) {
+            check({row, col});
+        }
+    }
+    check({Position::MAX_ROWS - 1, Position::MAX_COLS - 1});
+
+    for (const auto& [range, owner] : ranges) {
+        index.Remove(range, owner);
+    }
+    ASSERT_EQUAL(index.GetRangeCount(), 0u);
+    ASSERT(!index.IsCovered({0, 0}));
+}
 }  // namespace
 
 int main() {
@@ -372,5 +1567,30 @@ int main() {
     RUN_TEST(tr, TestCellReferences);
     RUN_TEST(tr, TestFormulaIncorrect);
     RUN_TEST(tr, TestCellCircularReferences);
+    RUN_TEST(tr, TestSparseStorage);
+    RUN_TEST(tr, TestCellStateTransitions);
+    RUN_TEST(tr, TestDependenciesRemovedOnOverwrite);
+    RUN_TEST(tr, TestClearCellInvalidatesDependents);
+    RUN_TEST(tr, TestRecalculateDiamonds);
+    RUN_TEST(tr, TestLongChainOrderAndCycles);
+    RUN_TEST(tr, TestFailedSetCellRollsBack);
+    RUN_TEST(tr, TestSetCellsBatch);
+    RUN_TEST(tr, TestParallelRecalculation);
+    RUN_TEST(tr, TestDeeplyNestedFormula);
+    RUN_TEST(tr, TestFastParserMatchesAntlr);
+    RUN_TEST(tr, TestFormulaShapesShared);
+    RUN_TEST(tr, TestErrorsPropagateAsValues);
+    RUN_TEST(tr, TestNumericTextCells);
+    RUN_TEST(tr, TestRangeAggregates);
+    RUN_TEST(tr, TestRangeScansFollowEdits);
+    RUN_TEST(tr, TestRangeDependencies);
+    RUN_TEST(tr, TestPrintMatchesStreamFormatting);
+    RUN_TEST(tr, TestSnapshotRoundTrip);
+    RUN_TEST(tr, TestImportTable);
+    RUN_TEST(tr, TestCalculationPolicies);
+    RUN_TEST(tr, TestSheetStats);
+    RUN_TEST(tr, TestPositionConstexpr);
+    RUN_TEST(tr, TestCellHashTable);
+    RUN_TEST(tr, TestRangeIndex);
     return 0;
 }
\ No newline at end of file
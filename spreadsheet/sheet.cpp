@@ -1,22 +1,148 @@
 #include "sheet.h"
 
+#include "FormulaAST.h"
 #include "cell.h"
 #include "common.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <charconv>
 #include <functional>
 #include <iostream>
+#include <locale>
 #include <optional>
+#include <sstream>
+#include <unordered_set>
 
 using namespace std::literals;
 
+namespace {
+// Меньшие пересчёты выгоднее выполнять в одном потоке
+const size_t PARALLEL_RECALCULATION_MIN_CELLS = 64;
+
+// Буфер вывода таблицы. Накапливает текст и передаёт его потоку блоками по
+// BUFFER_SIZE байт. Числа печатаются так же, как их напечатал бы сам поток:
+// при стандартных флагах форматирования и классической локали - через
+// std::to_chars в формате %g с точностью потока, иначе - через строковый
+// поток с форматом исходного.
+class OutputBuffer {
+public:
+    static constexpr size_t BUFFER_SIZE = 64 * 1024;
+
+    explicit OutputBuffer(std::ostream& output)
+        : output_(output)
+        , precision_(static_cast<int>(output.precision()))
+        , fast_numbers_((output.flags() & FORMAT_FLAGS) == 0 && precision_ >= 0
+                        && output.getloc() == std::locale::classic()) {
+        buffer_.reserve(BUFFER_SIZE);
+        number_stream_.copyfmt(output);
+        number_stream_.width(0);
+    }
+
+    void Append(std::string_view text) {
+        buffer_.append(text);
+        FlushIfFull();
+    }
+
+    void Append(char c, size_t count = 1) {
+        buffer_.append(count, c);
+        FlushIfFull();
+    }
+
+    void AppendNumber(double value) {
+        if (fast_numbers_) {
+            char number[NUMBER_SIZE];
+            auto result = std::to_chars(number, number + NUMBER_SIZE, value, std::chars_format::general, precision_);
+            if (result.ec == std::errc()) {
+                Append(std::string_view(number, result.ptr - number));
+                return;
+            }
+        }
+        number_stream_.str({});
+        number_stream_ << value;
+        Append(number_stream_.str());
+    }
+
+    void Flush() {
+        output_.write(buffer_.data(), buffer_.size());
+        buffer_.clear();
+    }
+
+private:
+    // Флаги, при которых вывод числа отличается от %g
+    static constexpr std::ios_base::fmtflags FORMAT_FLAGS = std::ios_base::floatfield | std::ios_base::showpoint
+                                                            | std::ios_base::showpos | std::ios_base::uppercase;
+    // Числа длиннее (при очень большой точности) печатаются через поток
+    static constexpr size_t NUMBER_SIZE = 128;
+
+    std::ostream& output_;
+    std::string buffer_;
+    int precision_;
+    bool fast_numbers_;
+    std::ostringstream number_stream_;
+
+    void FlushIfFull() {
+        if (buffer_.size() >= BUFFER_SIZE) {
+            Flush();
+        }
+    }
+};
+
+}
+
 void Sheet::SetCell(Position pos, std::string text) {
     if (!pos.IsValid()) {
         throw InvalidPositionException("Invalid position"s);
     }
-    ResizeSheetIfNeeded(pos);
-    ProcessCellSetting(std::move(pos), std::move(text));
+    // Формула разбирается до любых изменений таблицы: при синтаксической
+    // ошибке откатывать нечего
+    std::vector<std::pair<Position, Cell>> new_cells(1);
+    new_cells[0].first = pos;
+    new_cells[0].second.Set(std::move(text), pos, &cell_context_);
+    ProcessCellSetting(new_cells);
     InvalidateCache(pos);
+    ApplyCalculationPolicy();
+}
+
+void Sheet::SetCells(std::vector<std::pair<Position, std::string>> cells) {
+    for (const auto& [pos, text] : cells) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position"s);
+        }
+    }
+
+    // Если позиция встречается несколько раз, действует последнее значение
+    CellSet seen;
+    std::vector<std::pair<Position, Cell>> new_cells;
+    new_cells.reserve(cells.size());
+    for (auto it = cells.rbegin(); it != cells.rend(); ++it) {
+        if (!seen.insert(it->first).second) {
+            continue;
+        }
+        auto& [pos, cell] = new_cells.emplace_back();
+        pos = it->first;
+        cell.Set(std::move(it->second), pos, &cell_context_);
+    }
+    std::reverse(new_cells.begin(), new_cells.end());
+
+    ProcessCellSetting(new_cells);
+
+    std::vector<Position> changed;
+    changed.reserve(new_cells.size());
+    for (const auto& [pos, cell] : new_cells) {
+        changed.push_back(pos);
+    }
+    InvalidateCache(changed);
+    ApplyCalculationPolicy();
+}
+
+std::optional<FormulaError> Sheet::CollectRangeNumbers(CellRange range,
+                                                       std::vector<double>& numbers) const {
+    return columns_.CollectNumbers(range, numbers, [this](Position pos) {
+        const Cell* cell = cells_.Find(pos);
+        return cell ? cell->GetNumericValueInRange() : std::nullopt;
+    });
 }
 
 const CellInterface* Sheet::GetCell(Position pos) const {
@@ -24,18 +150,28 @@ const CellInterface* Sheet::GetCell(Position pos) const {
 }
 
 CellInterface* Sheet::GetCell(Position pos) {
-    if (!CheckPositionCorrectness(pos)) {
-        return nullptr;
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position"s);
     }
-    return &sheet_[pos.row][pos.col];
+    return cells_.Find(pos);
 }
 
 void Sheet::ClearCell(Position pos) {
-    if (!CheckPositionCorrectness(pos)) {
+    if (!pos.IsValid()) {
+        throw InvalidPositionException("Invalid position"s);
+    }
+    const Cell* cell = cells_.Find(pos);
+    if (!cell) {
         return;
     }
-    sheet_[pos.row][pos.col].Clear();
-    AdjustMapsAfterErasing(pos);
+    if (!cell->GetText().empty()) {
+        RemoveFromPrintableArea(pos);
+    }
+    graph_.RemovePrecedents(pos);
+    cells_.Erase(pos);
+    columns_.Reset(pos);
+    InvalidateCache(pos);
+    ApplyCalculationPolicy();
 }
 
 Size Sheet::GetPrintableSize() const {
@@ -51,116 +187,376 @@ Size Sheet::GetPrintableSize() const {
 }
 
 void Sheet::PrintValues(std::ostream& output) const {
-    Size printable_size = GetPrintableSize();
-    for (int row = 0; row < printable_size.rows; ++row) {
-        for (int col = 0; col < printable_size.cols; ++col) {
-            output << (col > 0 ? "\t" : "") << sheet_[row][col].GetValue();
+    PrintCells(output, [](OutputBuffer& buffer, const Cell& cell) {
+        if (cell.GetType() != Cell::Type::Formula) {
+            buffer.Append(cell.GetValueView());
         }
-        output << '\n';
-    }
+        else if (auto value = cell.GetNumericValue(); std::holds_alternative<double>(value)) {
+            buffer.AppendNumber(std::get<double>(value));
+        }
+        else {
+            buffer.Append(std::get<FormulaError>(value).ToString());
+        }
+    });
 }
 
 void Sheet::PrintTexts(std::ostream& output) const {
+    PrintCells(output, [](OutputBuffer& buffer, const Cell& cell) {
+        if (cell.GetType() != Cell::Type::Formula) {
+            buffer.Append(cell.GetTextView());
+        }
+        else {
+            buffer.Append(cell.GetText());
+        }
+    });
+}
+
+template <typename PrintCell>
+void Sheet::PrintCells(std::ostream& output, PrintCell print_cell) const {
     Size printable_size = GetPrintableSize();
+    OutputBuffer buffer(output);
     for (int row = 0; row < printable_size.rows; ++row) {
-        for (int col = 0; col < printable_size.cols; ++col) {
-            output << (col > 0 ? "\t" : "") << sheet_[row][col].GetText();
-        }
-        output << '\n';
+        // Столбец, в котором стоит курсор вывода
+        int current_col = 0;
+        cells_.ForEachInRow(row, printable_size.cols, [&](int col, const Cell& cell) {
+            buffer.Append('\t', col - current_col);
+            current_col = col;
+            print_cell(buffer, cell);
+        });
+        buffer.Append('\t', printable_size.cols - 1 - current_col);
+        buffer.Append('\n');
     }
+    buffer.Flush();
 }
 
-void Sheet::ResizeSheetIfNeeded(Position new_cell_pos) {
-    if (new_cell_pos.row >= static_cast<int>(sheet_.size())) {
-        size_t old_size = sheet_.size();
-        sheet_.resize(new_cell_pos.row + 1);
-        ResizeNewlyCreatedRows(old_size);
+RecalculationReport Sheet::Recalculate() {
+    RecalculationReport report;
+    report.dirty_cells = dirty_.size();
+    if (calculation_policy_ == CalculationPolicy::Manual) {
+        DiscardStaleValues();
     }
-    if (new_cell_pos.col >= static_cast<int>(sheet_[0].size())) {
-        for (auto& row : sheet_) {
-            row.resize(new_cell_pos.col + 1);
+
+    std::vector<Position> stale;
+    stale.reserve(dirty_.size());
+    for (Position pos : dirty_) {
+        const Cell* cell = cells_.Find(pos);
+        if (cell && !cell->IsCached()) {
+            stale.push_back(pos);
         }
     }
+
+    if (recalculation_pool_ && stale.size() >= PARALLEL_RECALCULATION_MIN_CELLS) {
+        RecalculateParallel(stale);
+    }
+    else {
+        RecalculateSerial(stale);
+    }
+    report.evaluated_cells = stale.size();
+
+    // Значения, вычисленные при пересчёте и лениво до него, переносятся в
+    // поколоночное хранилище после вычислений: потоки пересчёта его не меняют
+    for (Position pos : dirty_) {
+        SyncColumnStore(pos);
+    }
+    dirty_.clear();
+    return report;
+}
+
+void Sheet::SetRecalculationThreads(size_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (thread_count == 1) {
+        recalculation_pool_.reset();
+    }
+    else if (!recalculation_pool_ || recalculation_pool_->GetThreadCount() != thread_count) {
+        recalculation_pool_ = std::make_unique<WorkStealingPool>(thread_count);
+    }
+}
+
+void Sheet::SetCalculationPolicy(CalculationPolicy policy) {
+    if (calculation_policy_ == CalculationPolicy::Manual && policy != CalculationPolicy::Manual) {
+        DiscardStaleValues();
+    }
+    calculation_policy_ = policy;
+    ApplyCalculationPolicy();
+}
+
+CalculationPolicy Sheet::GetCalculationPolicy() const {
+    return calculation_policy_;
 }
 
-void Sheet::AdjustMapsAfterErasing(Position erased_pos) {
-    if (row_to_cell_count_.count(erased_pos.row)) {
-        --row_to_cell_count_[erased_pos.row];
-        if (row_to_cell_count_[erased_pos.row] == 0) {
-            row_to_cell_count_.erase(erased_pos.row);
+SheetStats Sheet::GetStats() const {
+    SheetStats stats;
+    stats.formula_evaluations = stats_.Get(StatsCounters::FormulaEvaluations);
+    stats.cache_hits = stats_.Get(StatsCounters::CacheHits);
+    stats.invalidations = stats_.Get(StatsCounters::Invalidations);
+    stats.invalidated_cells = stats_.Get(StatsCounters::InvalidatedCells);
+    stats.cycle_check_visits = graph_.GetVisitedCount();
+    stats.formulas_parsed = stats_.Get(StatsCounters::FormulasParsed);
+    stats.parse_nanoseconds = stats_.Get(StatsCounters::ParseNanoseconds);
+
+    // Программы общие для формул одной формы и считаются один раз
+    std::unordered_set<const FormulaAST*> programs;
+    stats.cell_bytes = cells_.GetMemoryUsage() + columns_.GetMemoryUsage();
+    cells_.ForEachCell([&](Position, const Cell& cell) {
+        stats.cell_bytes += cell.GetHeapSize();
+        if (const CellFormula* formula = cell.GetFormula();
+            formula && programs.insert(formula->GetProgram().get()).second) {
+            stats.formula_program_bytes += formula->GetProgram()->GetMemoryUsage();
         }
+    });
+    stats.dependency_graph_bytes = graph_.GetMemoryUsage();
+    return stats;
+}
+
+void Sheet::ResetStats() {
+    stats_.Reset();
+    graph_.ResetVisitedCount();
+}
+
+void Sheet::ApplyCalculationPolicy() {
+    if (calculation_policy_ == CalculationPolicy::Eager) {
+        Recalculate();
     }
-    if (col_to_cell_count_.count(erased_pos.col)) {
-        --col_to_cell_count_[erased_pos.col];
-        if (col_to_cell_count_[erased_pos.col] == 0) {
-            col_to_cell_count_.erase(erased_pos.col);
+}
+
+void Sheet::DiscardStaleValues() {
+    for (Position pos : dirty_) {
+        if (Cell* cell = cells_.Find(pos)) {
+            cell->InvalidateCache();
+            columns_.SetPending(pos);
         }
     }
 }
 
-void Sheet::ResizeNewlyCreatedRows(size_t old_size) {
-    for (size_t i = old_size; i < sheet_.size(); ++i) {
-        sheet_[i].resize(sheet_[0].size());
+void Sheet::RecalculateSerial(std::vector<Position>& stale) {
+    // В топологическом порядке все устаревшие зависимости ячейки вычисляются
+    // раньше неё, поэтому GetValue() не уходит в рекурсию. Номера ячеек
+    // запрашиваются у графа один раз, а не при каждом сравнении
+    std::vector<std::pair<int64_t, Position>> ordered;
+    ordered.reserve(stale.size());
+    for (const Position& pos : stale) {
+        ordered.emplace_back(graph_.GetOrder(pos), pos);
+    }
+    std::sort(ordered.begin(), ordered.end());
+    for (const auto& [order, pos] : ordered) {
+        cells_.Find(pos)->GetValue();
     }
 }
 
-void Sheet::ProcessCellSetting(Position pos, std::string text) {
-    std::string old_cell_state = GetCell(pos)->GetText();
-    sheet_[pos.row][pos.col].Set(text, this);
-    if (sheet_[pos.row][pos.col].GetType() == Cell::Type::Formula) {
-        auto old_dependencies_state = dependencies_;
-        for (const Position& referenced_pos : sheet_[pos.row][pos.col].GetReferencedCells()) {
-            dependencies_[referenced_pos].insert(pos);
+void Sheet::RecalculateParallel(const std::vector<Position>& stale) {
+    CellMap<size_t> index;
+    index.reserve(stale.size());
+    for (size_t i = 0; i < stale.size(); ++i) {
+        index.emplace(stale[i], i);
+    }
+
+    // Ячейка готова к вычислению, когда вычислены все её устаревшие прямые
+    // зависимости. Остальные зависимости уже закэшированы, поэтому потоки
+    // только читают их значения. Устаревшие ячейки, зависящие от каждой
+    // устаревшей ячейки, находятся заранее: их поиск учитывает диапазоны
+    std::vector<std::vector<size_t>> stale_dependents(stale.size());
+    std::vector<size_t> counts(stale.size());
+    for (size_t i = 0; i < stale.size(); ++i) {
+        for (const Position& dependent : graph_.GetDependents(stale[i])) {
+            if (auto it = index.find(dependent); it != index.end()) {
+                stale_dependents[i].push_back(it->second);
+                ++counts[it->second];
+            }
         }
-        if (IsCircularDependent(pos, pos)) {
-            dependencies_ = old_dependencies_state;
-            SetCell(pos, old_cell_state);
-            throw CircularDependencyException("Circular dependency"s);
+    }
+    std::vector<std::atomic<size_t>> pending_precedents(stale.size());
+    std::vector<size_t> ready;
+    for (size_t i = 0; i < stale.size(); ++i) {
+        pending_precedents[i].store(counts[i], std::memory_order_relaxed);
+        if (counts[i] == 0) {
+            ready.push_back(i);
+        }
+    }
+
+    recalculation_pool_->Run(ready, stale.size(), [&](size_t task, WorkStealingPool::Context& context) {
+        cells_.Find(stale[task])->GetValue();
+        for (size_t dependent : stale_dependents[task]) {
+            if (pending_precedents[dependent].fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                context.Spawn(dependent);
+            }
         }
+    });
+}
+
+void Sheet::SyncColumnStore(Position pos) {
+    const Cell* cell = cells_.Find(pos);
+    if (!cell) {
+        columns_.Reset(pos);
+        return;
+    }
+    if (cell->GetType() == Cell::Type::Formula && !cell->IsCached()) {
+        columns_.SetPending(pos);
+        return;
+    }
+    auto value = cell->GetNumericValueInRange();
+    if (!value) {
+        columns_.Reset(pos);
     }
+    else if (const double* number = std::get_if<double>(&*value)) {
+        columns_.SetNumber(pos, *number);
+    }
+    else {
+        // Ошибку хранит сама ячейка
+        columns_.SetPending(pos);
+    }
+}
+
+void Sheet::AddToPrintableArea(Position pos) {
     ++row_to_cell_count_[pos.row];
     ++col_to_cell_count_[pos.col];
 }
 
-bool Sheet::CheckPositionCorrectness(Position pos) const {
-    if (!pos.IsValid()) {
-        throw InvalidPositionException("Invalid position"s);
-    }
-    if (sheet_.size() == 0) {
-        return false;
+void Sheet::RemoveFromPrintableArea(Position pos) {
+    if (row_to_cell_count_.count(pos.row)) {
+        --row_to_cell_count_[pos.row];
+        if (row_to_cell_count_[pos.row] == 0) {
+            row_to_cell_count_.erase(pos.row);
+        }
     }
-    if (pos.row >= static_cast<int>(sheet_.size()) || pos.col >= static_cast<int>(sheet_[0].size())) {
-        return false;
+    if (col_to_cell_count_.count(pos.col)) {
+        --col_to_cell_count_[pos.col];
+        if (col_to_cell_count_[pos.col] == 0) {
+            col_to_cell_count_.erase(pos.col);
+        }
     }
-    return true;
 }
 
-void Sheet::InvalidateCache(Position pos) {
-    GetCell(pos)->InvalidateCache();
-    if (!dependencies_.count(pos)) {
-        return;
+void Sheet::ProcessCellSetting(std::vector<std::pair<Position, Cell>>& new_cells, bool bulk) {
+    std::vector<bool> was_printable;
+    was_printable.reserve(new_cells.size());
+    for (auto& [pos, new_cell] : new_cells) {
+        const Cell* old_cell = cells_.Find(pos);
+        was_printable.push_back(old_cell && old_cell->GetType() != Cell::Type::Empty);
+        SaveForUndo(pos) = std::move(new_cell);
+    }
+
+    // Сначала удаляются все старые рёбра, затем добавляются все новые:
+    // проверка на циклы выполняется один раз для всех изменённых ячеек
+    for (const auto& [pos, new_cell] : new_cells) {
+        graph_.RemovePrecedents(pos);
+    }
+    if (bulk) {
+        for (const auto& [pos, new_cell] : new_cells) {
+            const Cell* cell = cells_.Find(pos);
+            graph_.RestorePrecedents(pos, cell->GetReferencedCells(), cell->GetReferencedRanges(), 0);
+        }
+        // Неудачная перестройка не меняет порядок остальных ячеек, так что
+        // откат восстанавливает прежние рёбра обычным способом
+        if (!graph_.RebuildOrder()) {
+            Rollback();
+            throw CircularDependencyException("Circular dependency"s);
+        }
+    }
+    else {
+        for (const auto& [pos, new_cell] : new_cells) {
+            const Cell* cell = cells_.Find(pos);
+            if (!graph_.AddPrecedents(pos, cell->GetReferencedCells(), cell->GetReferencedRanges())) {
+                Rollback();
+                throw CircularDependencyException("Circular dependency"s);
+            }
+        }
+    }
+    undo_log_.clear();
+
+    for (size_t i = 0; i < new_cells.size(); ++i) {
+        // Ячейки, на которые ссылается формула, должны существовать
+        // (возможно, пустыми), чтобы GetCell() для них не возвращал nullptr.
+        // Ячейки диапазонов не создаются: диапазон может быть огромным
+        for (const Position& referenced_pos : cells_.Find(new_cells[i].first)->GetReferencedCells()) {
+            cells_.GetOrCreate(referenced_pos);
+        }
+
+        Position pos = new_cells[i].first;
+        SyncColumnStore(pos);
+        bool is_printable = cells_.Find(pos)->GetType() != Cell::Type::Empty;
+        if (!was_printable[i] && is_printable) {
+            AddToPrintableArea(pos);
+        }
+        else if (was_printable[i] && !is_printable) {
+            RemoveFromPrintableArea(pos);
+        }
     }
-    for (const Position& pos : dependencies_.at(pos)) {
-        InvalidateCache(pos);
+}
+
+Cell& Sheet::SaveForUndo(Position pos) {
+    UndoRecord& record = undo_log_.emplace_back(
+        UndoRecord{pos, std::nullopt, graph_.GetPrecedents(pos), graph_.GetPrecedentRanges(pos)});
+    if (Cell* cell = cells_.Find(pos)) {
+        record.cell = std::move(*cell);
+        return *cell;
     }
+    return cells_.GetOrCreate(pos);
 }
 
-bool Sheet::IsCircularDependent(Position pos, Position initial_pos) {
-    if (dependencies_.count(pos) == 0) {
-        return false;
+void Sheet::Rollback() {
+    for (const UndoRecord& record : undo_log_) {
+        graph_.RemovePrecedents(record.pos);
     }
-    if (dependencies_.at(pos).count(initial_pos)) {
-        return true;
+    for (UndoRecord& record : undo_log_) {
+        // Прежнее состояние графа было ациклическим, так что рёбра
+        // восстанавливаются без ошибок
+        [[maybe_unused]] bool restored = graph_.AddPrecedents(record.pos, record.precedents, record.precedent_ranges);
+        assert(restored);
+        if (record.cell) {
+            cells_.GetOrCreate(record.pos) = std::move(*record.cell);
+        }
+        else {
+            cells_.Erase(record.pos);
+        }
     }
-    for (const Position& referenced_pos : dependencies_.at(pos)) {
-        if (!dependencies_.count(referenced_pos)) {
-            continue;
+    undo_log_.clear();
+}
+
+void Sheet::InvalidateCache(Position pos) {
+    InvalidateCache(std::vector<Position>{pos});
+}
+
+void Sheet::InvalidateCache(const std::vector<Position>& changed) {
+    uint64_t invalidated_count = 0;
+    std::vector<Position> stack;
+    for (const Position& pos : changed) {
+        Cell* cell = cells_.Find(pos);
+        if (cell && cell->GetType() == Cell::Type::Formula) {
+            cell->InvalidateCache();
+            columns_.SetPending(pos);
+            dirty_.insert(pos);
+            ++invalidated_count;
+        }
+        std::vector<Position> dependents = graph_.GetDependents(pos);
+        stack.insert(stack.end(), dependents.begin(), dependents.end());
+    }
+
+    const bool keep_values = calculation_policy_ == CalculationPolicy::Manual;
+    while (!stack.empty()) {
+        Position dependent_pos = stack.back();
+        stack.pop_back();
+        Cell* dependent = cells_.Find(dependent_pos);
+        if (keep_values) {
+            if (!dependent || !dirty_.insert(dependent_pos).second) {
+                continue;
+            }
         }
-        if (IsCircularDependent(referenced_pos, initial_pos)) {
-            return true;
+        else {
+            if (!dependent || !dependent->IsCached()) {
+                continue;
+            }
+            dependent->InvalidateCache();
+            columns_.SetPending(dependent_pos);
+            dirty_.insert(dependent_pos);
         }
+        ++invalidated_count;
+        std::vector<Position> next = graph_.GetDependents(dependent_pos);
+        stack.insert(stack.end(), next.begin(), next.end());
     }
-    return false;
+    stats_.Add(StatsCounters::Invalidations);
+    stats_.Add(StatsCounters::InvalidatedCells, invalidated_count);
 }
 
 std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value) {
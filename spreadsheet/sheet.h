@@ -3,11 +3,15 @@
 #include <functional>
 #include <vector>
 #include <map>
-#include <unordered_map>
-#include <unordered_set>
+#include <optional>
 
 #include "common.h"
 #include "cell.h"
+#include "cell_hash_table.h"
+#include "cell_storage.h"
+#include "column_store.h"
+#include "dependency_graph.h"
+#include "thread_pool.h"
 
 class Sheet : public SheetInterface {
 public:
@@ -15,6 +19,7 @@ public:
     ~Sheet() = default;
 
     void SetCell(Position pos, std::string text) override;
+    void SetCells(std::vector<std::pair<Position, std::string>> cells) override;
 
     const CellInterface* GetCell(Position pos) const override;
     CellInterface* GetCell(Position pos) override;
@@ -23,30 +28,102 @@ public:
 
     Size GetPrintableSize() const override;
 
+    std::optional<FormulaError> CollectRangeNumbers(CellRange range,
+                                                    std::vector<double>& numbers) const override;
+
     void PrintValues(std::ostream& output) const override;
     void PrintTexts(std::ostream& output) const override;
 
+    RecalculationReport Recalculate() override;
+    void SetRecalculationThreads(size_t thread_count) override;
+    void SetCalculationPolicy(CalculationPolicy policy) override;
+    CalculationPolicy GetCalculationPolicy() const override;
+
+    SheetStats GetStats() const override;
+    void ResetStats() override;
+
+    void ImportTable(std::istream& input, TableFormat format) override;
+
+    void SaveSnapshot(std::ostream& output) const override;
+    // Заполняет пустую таблицу из снимка. Бросает SnapshotException, если
+    // снимок некорректен; таблица при этом остаётся в неопределённом
+    // состоянии и должна быть удалена.
+    void RestoreSnapshot(std::string_view data);
+
 private:
-	std::vector<std::vector<Cell>> sheet_;
+    CellStorage cells_;
+    // Количество ячеек с непустым текстом в каждой строке и столбце.
+    // Используется для вычисления печатаемой области.
     std::map<int, int> row_to_cell_count_;
     std::map<int, int> col_to_cell_count_; 
 
-    // Структура: ключ - позиция некоторой формульной ячейки,
-    // значение - множество ячеек, непосредственно зависящих от данной.
-    std::unordered_map<Position, std::unordered_set<Position, PositionHasher>, PositionHasher> dependencies_;
-
-    void ResizeSheetIfNeeded(Position new_cell_pos);
-    void AdjustMapsAfterErasing(Position erased_pos);
-    void ResizeNewlyCreatedRows(size_t old_size);
-    void ProcessCellSetting(Position pos, std::string text);
-    bool CheckPositionCorrectness(Position pos) const;
-    // Возвращает true, если формульная ячейка на позиции new_cell_pos
-    // содержит циклические зависимости.
-    // Метод SetCell на основании результата работы этого метода будет
-    // либо выбрасывать исключение CircularDependencyException,
-    // либо продолжать работу
-    bool IsCircularDependent(Position new_cell_pos, Position initial_pos);
+    // Числовые значения ячеек по столбцам для быстрого чтения диапазонов.
+    // Формулы, кэш которых сброшен, отмечены в нём как требующие вычисления;
+    // их значения попадают в хранилище при пересчёте.
+    ColumnStore columns_;
+
+    DependencyGraph graph_;
+    // Формульные ячейки, значения которых устарели с момента последнего
+    // пересчёта. При политике Lazy и Eager их кэш сброшен, и часть из них
+    // могла быть вычислена лениво при чтении. При политике Manual они хранят
+    // прежние значения до пересчёта.
+    CellSet dirty_;
+    CalculationPolicy calculation_policy_ = CalculationPolicy::Lazy;
+
+    // Прежнее состояние ячейки, изменённой в ходе текущей операции записи
+    struct UndoRecord {
+        Position pos;
+        std::optional<Cell> cell;  // пусто, если ячейки не существовало
+        std::vector<Position> precedents;
+        std::vector<CellRange> precedent_ranges;
+    };
+    // Журнал отката: хранит только затронутые ячейки и их рёбра, поэтому
+    // откат стоит O(изменений), а не O(размера таблицы). Каждая позиция
+    // встречается в журнале не более одного раза.
+    std::vector<UndoRecord> undo_log_;
+
+    StatsCounters stats_;
+    // Окружение, общее для всех формульных ячеек таблицы
+    CellContext cell_context_{this, &stats_};
+
+    // Пул для параллельного пересчёта; отсутствует при пересчёте в один поток
+    std::unique_ptr<WorkStealingPool> recalculation_pool_;
+
+    // Выводит печатаемую область построчно, вызывая для каждой существующей
+    // ячейки print_cell(buffer, cell). Вывод копится в буфере и пишется в
+    // поток крупными блоками; пустые ячейки дают только разделители.
+    template <typename PrintCell>
+    void PrintCells(std::ostream& output, PrintCell print_cell) const;
+    // Переносит в columns_ текущее значение ячейки
+    void SyncColumnStore(Position pos);
+    void AddToPrintableArea(Position pos);
+    void RemoveFromPrintableArea(Position pos);
+    // Записывает уже разобранные ячейки и обновляет граф зависимостей.
+    // Если новые рёбра образуют цикл, все изменения откатываются и
+    // бросается CircularDependencyException. При bulk рёбра добавляются без
+    // проверок, а порядок графа строится заново одним проходом: для больших
+    // пакетов это дешевле, чем поддерживать порядок после каждой ячейки.
+    void ProcessCellSetting(std::vector<std::pair<Position, Cell>>& new_cells, bool bulk = false);
+    // Переносит текущее состояние ячейки в журнал отката и возвращает
+    // ячейку, в которую нужно записать новое состояние
+    Cell& SaveForUndo(Position pos);
+    void Rollback();
+    // Сбрасывает кэш изменённых ячеек и всех ячеек, транзитивно зависящих от
+    // них. Обход останавливается на ячейках, кэш которых уже сброшен: всё,
+    // что зависит от них, тоже не закэшировано. Поэтому каждая затронутая
+    // ячейка посещается один раз.
+    // При политике Manual зависимые ячейки только отмечаются в dirty_, а их
+    // кэш остаётся; обход останавливается на уже отмеченных ячейках.
     void InvalidateCache(Position pos);
+    void InvalidateCache(const std::vector<Position>& changed);
+    // Сбрасывает кэш ячеек из dirty_, хранящих прежние значения
+    void DiscardStaleValues();
+    // Завершает операцию записи: при политике Eager пересчитывает таблицу
+    void ApplyCalculationPolicy();
+    // Вычисляют устаревшие ячейки: по одной в топологическом порядке либо
+    // параллельно, по мере готовности их зависимостей
+    void RecalculateSerial(std::vector<Position>& stale);
+    void RecalculateParallel(const std::vector<Position>& stale);
 };
 
 std::ostream& operator<<(std::ostream& output, const CellInterface::Value& value);
\ No newline at end of file
@@ -0,0 +1,469 @@
+#include "FormulaAST.h"
+#include "sheet.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std::literals;
+
+// Формат снимка. Все поля записываются в порядке байт машины, записавшей
+// снимок; размеры записей кратны 8, поэтому каждая секция выровнена:
+//     Header
+//     ProgramRecord[program_count]          - программы формул
+//     InstructionRecord[instruction_count]  - инструкции всех программ подряд
+//     CellRecord[cell_count]                - ячейки
+//     char[text_size]                       - тексты текстовых ячеек подряд
+// Программы хранятся в относительной форме (см. CellFormula) по одной на
+// форму, так что формулы одинаковой формы и после загрузки делят программу.
+// Ссылки формул на ячейки и диапазоны восстанавливаются из самих программ.
+namespace {
+constexpr char SNAPSHOT_MAGIC[8] = {'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P'};
+// Версия 2: ячейка-аргумент агрегатной функции - отдельная инструкция
+constexpr uint32_t SNAPSHOT_VERSION = 2;
+constexpr uint32_t BYTE_ORDER_MARK = 0x01020304;
+// Номера в порядке графа далеко от границ int64_t, чтобы новые вершины
+// после загрузки получали номера без переполнения
+constexpr int64_t MAX_ORDER = int64_t{1} << 62;
+
+struct Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t program_count;
+    uint64_t instruction_count;
+    uint64_t cell_count;
+    uint64_t text_size;
+};
+
+struct ProgramRecord {
+    uint64_t first_instruction;
+    uint64_t instruction_count;
+};
+
+struct InstructionRecord {
+    uint8_t code;
+    uint8_t function;
+    uint8_t padding[6];
+    unsigned char operand[8];
+};
+
+enum class ValueKind : uint8_t {
+    None,    // значение формулы не вычислено
+    Number,
+    Error,
+};
+
+struct CellRecord {
+    int32_t row;
+    int32_t col;
+    uint8_t type;        // Cell::Type
+    uint8_t value_kind;  // ValueKind
+    uint8_t error;       // FormulaError::Category
+    uint8_t padding[5];
+    // Для текста - смещение в секции текстов, для формулы - номер программы
+    uint64_t payload;
+    uint64_t text_size;
+    int64_t order;       // номер формулы в топологическом порядке
+    double number;
+};
+
+static_assert(sizeof(Header) == 48 && sizeof(ProgramRecord) == 16 && sizeof(InstructionRecord) == 16
+              && sizeof(CellRecord) == 48);
+static_assert(sizeof(ASTImpl::Instruction::operand) == sizeof(InstructionRecord::operand));
+
+template <typename T>
+void Write(std::string& out, const T& value) {
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Читает записи снимка. Записи копируются из отображения через memcpy,
+// поэтому данные в памяти могут быть и не выровнены.
+class SnapshotReader {
+public:
+    explicit SnapshotReader(std::string_view data)
+        : data_(data) {
+        if (data.size() < sizeof(Header)) {
+            Fail("file is too short");
+        }
+        std::memcpy(&header_, data.data(), sizeof(Header));
+        if (std::memcmp(header_.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0) {
+            Fail("not a sheet snapshot");
+        }
+        if (header_.byte_order != BYTE_ORDER_MARK) {
+            Fail("written on a machine with a different byte order");
+        }
+        if (header_.version != SNAPSHOT_VERSION) {
+            Fail("unsupported version " + std::to_string(header_.version));
+        }
+
+        size_t offset = sizeof(Header);
+        programs_ = TakeSection(offset, header_.program_count, sizeof(ProgramRecord));
+        instructions_ = TakeSection(offset, header_.instruction_count, sizeof(InstructionRecord));
+        cells_ = TakeSection(offset, header_.cell_count, sizeof(CellRecord));
+        texts_ = TakeSection(offset, header_.text_size, 1);
+        if (offset != data.size()) {
+            Fail("unexpected trailing data");
+        }
+    }
+
+    const Header& GetHeader() const {
+        return header_;
+    }
+
+    ProgramRecord GetProgram(size_t index) const {
+        return Get<ProgramRecord>(programs_, index);
+    }
+
+    InstructionRecord GetInstruction(size_t index) const {
+        return Get<InstructionRecord>(instructions_, index);
+    }
+
+    CellRecord GetCell(size_t index) const {
+        return Get<CellRecord>(cells_, index);
+    }
+
+    std::string_view GetText(uint64_t offset, uint64_t size) const {
+        if (offset > texts_.size() || size > texts_.size() - offset) {
+            Fail("text out of bounds");
+        }
+        return texts_.substr(offset, size);
+    }
+
+    [[noreturn]] static void Fail(const std::string& what) {
+        throw SnapshotException("Invalid snapshot: " + what);
+    }
+
+private:
+    std::string_view data_;
+    Header header_;
+    std::string_view programs_;
+    std::string_view instructions_;
+    std::string_view cells_;
+    std::string_view texts_;
+
+    std::string_view TakeSection(size_t& offset, uint64_t count, size_t record_size) {
+        size_t available = data_.size() - offset;
+        if (count > available / record_size) {
+            Fail("section out of bounds");
+        }
+        std::string_view section = data_.substr(offset, count * record_size);
+        offset += section.size();
+        return section;
+    }
+
+    template <typename Record>
+    static Record Get(std::string_view section, size_t index) {
+        Record record;
+        std::memcpy(&record, section.data() + index * sizeof(Record), sizeof(Record));
+        return record;
+    }
+};
+
+// Файл, отображённый в память только для чтения
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& path) {
+#ifndef _WIN32
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw SnapshotException("Cannot open snapshot "s + path);
+        }
+        struct stat file_stat;
+        if (fstat(fd, &file_stat) != 0) {
+            close(fd);
+            throw SnapshotException("Cannot open snapshot "s + path);
+        }
+        size_ = static_cast<size_t>(file_stat.st_size);
+        if (size_ > 0) {
+            void* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                throw SnapshotException("Cannot map snapshot "s + path);
+            }
+            // Снимок читается один раз от начала до конца
+            madvise(data, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(data);
+        }
+        close(fd);
+#else
+        std::ifstream input(path, std::ios::binary);
+        if (!input) {
+            throw SnapshotException("Cannot open snapshot "s + path);
+        }
+        buffer_.assign(std::istreambuf_iterator<char>(input), std::istreambuf_iterator<char>());
+        data_ = buffer_.data();
+        size_ = buffer_.size();
+#endif
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+#ifndef _WIN32
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+#endif
+    }
+
+    std::string_view GetData() const {
+        return {data_, size_};
+    }
+
+private:
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+#ifdef _WIN32
+    std::string buffer_;
+#endif
+};
+
+std::shared_ptr<const FormulaAST> ReadProgram(const SnapshotReader& reader, const ProgramRecord& record) {
+    uint64_t instruction_count = reader.GetHeader().instruction_count;
+    if (record.first_instruction > instruction_count
+        || record.instruction_count > instruction_count - record.first_instruction) {
+        SnapshotReader::Fail("program out of bounds");
+    }
+    std::vector<ASTImpl::Instruction> program(record.instruction_count);
+    for (size_t i = 0; i < program.size(); ++i) {
+        InstructionRecord instruction = reader.GetInstruction(record.first_instruction + i);
+        program[i].code = static_cast<ASTImpl::Instruction::Code>(instruction.code);
+        program[i].function = static_cast<ASTImpl::Instruction::Function>(instruction.function);
+        std::memcpy(&program[i].operand, instruction.operand, sizeof(instruction.operand));
+    }
+    try {
+        return std::make_shared<const FormulaAST>(std::move(program));
+    } catch (const FormulaException& e) {
+        SnapshotReader::Fail(e.what());
+    }
+}
+
+bool IsValidRange(CellRange range) {
+    return range.first.IsValid() && range.last.IsValid() && range.first.row <= range.last.row
+           && range.first.col <= range.last.col;
+}
+}  // namespace
+
+void Sheet::SaveSnapshot(std::ostream& output) const {
+    std::unordered_map<const FormulaAST*, uint64_t> program_indices;
+    std::string programs;
+    std::string instructions;
+    std::string cells;
+    std::string texts;
+    uint64_t instruction_count = 0;
+    uint64_t cell_count = 0;
+
+    cells_.ForEachCell([&](Position pos, const Cell& cell) {
+        CellRecord record = {};
+        record.row = pos.row;
+        record.col = pos.col;
+        record.type = static_cast<uint8_t>(cell.GetType());
+        if (cell.GetType() == Cell::Type::Text) {
+            std::string_view text = cell.GetTextView();
+            record.payload = texts.size();
+            record.text_size = text.size();
+            texts.append(text);
+        }
+        else if (const CellFormula* formula = cell.GetFormula()) {
+            const FormulaAST* program = formula->GetProgram().get();
+            auto [it, inserted] = program_indices.emplace(program, program_indices.size());
+            if (inserted) {
+                Write(programs, ProgramRecord{instruction_count, program->GetProgram().size()});
+                for (const ASTImpl::Instruction& instruction : program->GetProgram()) {
+                    InstructionRecord instruction_record = {};
+                    instruction_record.code = instruction.code;
+                    instruction_record.function = instruction.function;
+                    std::memcpy(instruction_record.operand, &instruction.operand, sizeof(instruction.operand));
+                    Write(instructions, instruction_record);
+                }
+                instruction_count += program->GetProgram().size();
+            }
+            record.payload = it->second;
+            record.order = graph_.GetPrecedents(pos).empty() && graph_.GetPrecedentRanges(pos).empty()
+                               ? 0
+                               : graph_.GetOrder(pos);
+            // Прежние значения, хранимые до пересчёта при политике Manual,
+            // в снимок не попадают
+            bool stale = calculation_policy_ == CalculationPolicy::Manual && dirty_.count(pos) > 0;
+            if (cell.IsCached() && !stale) {
+                auto value = cell.GetNumericValue();
+                if (const double* number = std::get_if<double>(&value)) {
+                    record.value_kind = static_cast<uint8_t>(ValueKind::Number);
+                    record.number = *number;
+                }
+                else {
+                    record.value_kind = static_cast<uint8_t>(ValueKind::Error);
+                    record.error = static_cast<uint8_t>(std::get<FormulaError>(value).GetCategory());
+                }
+            }
+        }
+        Write(cells, record);
+        ++cell_count;
+    });
+
+    Header header = {};
+    std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    header.version = SNAPSHOT_VERSION;
+    header.byte_order = BYTE_ORDER_MARK;
+    header.program_count = program_indices.size();
+    header.instruction_count = instruction_count;
+    header.cell_count = cell_count;
+    header.text_size = texts.size();
+
+    output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    output.write(programs.data(), programs.size());
+    output.write(instructions.data(), instructions.size());
+    output.write(cells.data(), cells.size());
+    output.write(texts.data(), texts.size());
+}
+
+void Sheet::RestoreSnapshot(std::string_view data) {
+    SnapshotReader reader(data);
+    const Header& header = reader.GetHeader();
+
+    std::vector<std::shared_ptr<const FormulaAST>> programs(header.program_count);
+    for (size_t i = 0; i < programs.size(); ++i) {
+        programs[i] = ReadProgram(reader, reader.GetProgram(i));
+    }
+
+    std::vector<Position> positions;
+    positions.reserve(header.cell_count);
+    std::vector<Position> formulas;
+    std::unordered_set<int64_t> orders;
+    for (size_t i = 0; i < header.cell_count; ++i) {
+        CellRecord record = reader.GetCell(i);
+        Position pos{record.row, record.col};
+        if (!pos.IsValid()) {
+            reader.Fail("invalid cell position");
+        }
+        if (cells_.Find(pos)) {
+            reader.Fail("duplicate cell " + pos.ToString());
+        }
+        Cell& cell = cells_.GetOrCreate(pos);
+        positions.push_back(pos);
+
+        switch (record.type) {
+            case Cell::Type::Empty:
+                break;
+            case Cell::Type::Text: {
+                std::string_view text = reader.GetText(record.payload, record.text_size);
+                if (text.empty() || (text[0] == FORMULA_SIGN && text.size() > 1)) {
+                    reader.Fail("invalid text of cell " + pos.ToString());
+                }
+                cell.Set(std::string(text), pos, &cell_context_);
+                break;
+            }
+            case Cell::Type::Formula: {
+                if (record.payload >= programs.size()) {
+                    reader.Fail("program out of bounds");
+                }
+                CellFormula formula(programs[record.payload], pos);
+                std::vector<Position> referenced_cells = formula.GetReferencedCells();
+                std::vector<CellRange> referenced_ranges = formula.GetReferencedRanges();
+                for (const Position& referenced : referenced_cells) {
+                    if (!referenced.IsValid()) {
+                        reader.Fail("invalid reference in cell " + pos.ToString());
+                    }
+                }
+                for (const CellRange& range : referenced_ranges) {
+                    if (!IsValidRange(range)) {
+                        reader.Fail("invalid range in cell " + pos.ToString());
+                    }
+                }
+
+                std::optional<CellInterface::NumericValue> value;
+                switch (static_cast<ValueKind>(record.value_kind)) {
+                    case ValueKind::None:
+                        dirty_.insert(pos);
+                        break;
+                    case ValueKind::Number:
+                        if (!std::isfinite(record.number)) {
+                            reader.Fail("invalid value of cell " + pos.ToString());
+                        }
+                        value = record.number;
+                        break;
+                    case ValueKind::Error:
+                        if (record.error > static_cast<uint8_t>(FormulaError::Category::Div0)) {
+                            reader.Fail("invalid value of cell " + pos.ToString());
+                        }
+                        value = FormulaError(static_cast<FormulaError::Category>(record.error));
+                        break;
+                    default:
+                        reader.Fail("invalid value of cell " + pos.ToString());
+                }
+
+                if (!referenced_cells.empty() || !referenced_ranges.empty()) {
+                    if (record.order < -MAX_ORDER || record.order > MAX_ORDER || !orders.insert(record.order).second) {
+                        reader.Fail("invalid order of cell " + pos.ToString());
+                    }
+                    graph_.RestorePrecedents(pos, referenced_cells, referenced_ranges, record.order);
+                }
+                cell.SetFormula(std::move(formula), &cell_context_, value);
+                formulas.push_back(pos);
+                break;
+            }
+            default:
+                reader.Fail("invalid type of cell " + pos.ToString());
+        }
+        if (cell.GetType() != Cell::Type::Empty) {
+            AddToPrintableArea(pos);
+        }
+    }
+
+    // Сохранённый порядок избавляет от поиска циклов, но проверить его
+    // нужно: повреждённый снимок мог бы зациклить вычисления
+    for (const Position& pos : formulas) {
+        if (!graph_.CheckOrder(pos)) {
+            reader.Fail("dependencies of cell " + pos.ToString() + " are out of order");
+        }
+        for (const Position& referenced : cells_.Find(pos)->GetReferencedCells()) {
+            if (!cells_.Find(referenced)) {
+                cells_.GetOrCreate(referenced);
+                positions.push_back(referenced);
+            }
+        }
+    }
+    // Сохранённое значение формулы, зависящей от невычисленной ячейки,
+    // отбрасывается: InvalidateCache() полагается на то, что всё зависящее
+    // от незакэшированной ячейки тоже не закэшировано
+    std::vector<Position> stack(dirty_.begin(), dirty_.end());
+    while (!stack.empty()) {
+        Position pos = stack.back();
+        stack.pop_back();
+        for (const Position& dependent : graph_.GetDependents(pos)) {
+            Cell* cell = cells_.Find(dependent);
+            if (cell && cell->IsCached()) {
+                cell->InvalidateCache();
+                dirty_.insert(dependent);
+                stack.push_back(dependent);
+            }
+        }
+    }
+    for (const Position& pos : positions) {
+        SyncColumnStore(pos);
+    }
+}
+
+std::unique_ptr<SheetInterface> LoadSnapshot(const std::string& path) {
+    MappedFile file(path);
+    return LoadSnapshotFromMemory(file.GetData());
+}
+
+std::unique_ptr<SheetInterface> LoadSnapshotFromMemory(std::string_view data) {
+    auto sheet = std::make_unique<Sheet>();
+    sheet->RestoreSnapshot(data);
+    return sheet;
+}
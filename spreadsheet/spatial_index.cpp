@@ -0,0 +1,156 @@
+#include "spatial_index.h"
+
+#include <algorithm>
+#include <cassert>
+#include <tuple>
+
+namespace {
+// Оценка памяти, занимаемой хэш-таблицей стандартной библиотеки: массив
+// корзин и по узлу на элемент (ссылка на следующий узел, элемент и его
+// сохранённый хэш). Память, принадлежащая самим элементам, не учитывается.
+template <typename HashTable>
+size_t GetHashTableMemoryUsage(const HashTable& table) {
+    struct Node {
+        void* next;
+        typename HashTable::value_type value;
+        size_t hash;
+    };
+    return table.bucket_count() * sizeof(void*) + table.size() * sizeof(Node);
+}
+}  // namespace
+
+int TileGrid::GetTile(Position pos) {
+    return pos.row / TILE_SIZE * TILE_COLS + pos.col / TILE_SIZE;
+}
+
+size_t TileGrid::GetTileCount(CellRange range) {
+    size_t rows = range.last.row / TILE_SIZE - range.first.row / TILE_SIZE + 1;
+    size_t cols = range.last.col / TILE_SIZE - range.first.col / TILE_SIZE + 1;
+    return rows * cols;
+}
+
+bool RangeIndex::ByFirstRow::operator()(const Entry& lhs, const Entry& rhs) const {
+    return std::tie(lhs.range.first.row, lhs.range.first.col, lhs.range.last.row, lhs.range.last.col, lhs.owner.row,
+                    lhs.owner.col)
+           < std::tie(rhs.range.first.row, rhs.range.first.col, rhs.range.last.row, rhs.range.last.col,
+                      rhs.owner.row, rhs.owner.col);
+}
+
+bool RangeIndex::ByLastRow::operator()(const Entry& lhs, const Entry& rhs) const {
+    return std::tie(rhs.range.last.row, lhs.range.first.row, lhs.range.first.col, lhs.range.last.col, lhs.owner.row,
+                    lhs.owner.col)
+           < std::tie(lhs.range.last.row, rhs.range.first.row, rhs.range.first.col, rhs.range.last.col,
+                      rhs.owner.row, rhs.owner.col);
+}
+
+void RangeIndex::Add(CellRange range, Position owner) {
+    ++range_count_;
+    int row_level = GetLevel(range.first.row, range.last.row);
+    int col_level = GetLevel(range.first.col, range.last.col);
+    RowNode& row_node = row_nodes_[GetNodeId(row_level, range.first.row)];
+    Node& node = row_node.col_nodes[GetNodeId(col_level, range.first.col)];
+    node.by_first_row.insert({range, owner});
+    node.by_last_row.insert({range, owner});
+
+    ++row_node.col_level_counts[col_level];
+    row_node.col_levels |= 1u << col_level;
+    ++row_level_counts_[row_level];
+    row_levels_ |= 1u << row_level;
+}
+
+void RangeIndex::Remove(CellRange range, Position owner) {
+    --range_count_;
+    int row_level = GetLevel(range.first.row, range.last.row);
+    int col_level = GetLevel(range.first.col, range.last.col);
+    auto row_it = row_nodes_.find(GetNodeId(row_level, range.first.row));
+    assert(row_it != row_nodes_.end());
+    RowNode& row_node = row_it->second;
+    auto it = row_node.col_nodes.find(GetNodeId(col_level, range.first.col));
+    assert(it != row_node.col_nodes.end());
+    Node& node = it->second;
+
+    // Одинаковые пары неразличимы, так что удаляется любая из них
+    Entry entry{range, owner};
+    auto first_row_it = node.by_first_row.find(entry);
+    assert(first_row_it != node.by_first_row.end());
+    node.by_first_row.erase(first_row_it);
+    node.by_last_row.erase(node.by_last_row.find(entry));
+    if (node.by_first_row.empty()) {
+        row_node.col_nodes.erase(it);
+    }
+
+    if (--row_node.col_level_counts[col_level] == 0) {
+        row_node.col_levels &= ~(1u << col_level);
+    }
+    if (row_node.col_nodes.empty()) {
+        row_nodes_.erase(row_it);
+    }
+    if (--row_level_counts_[row_level] == 0) {
+        row_levels_ &= ~(1u << row_level);
+    }
+}
+
+bool RangeIndex::IsCovered(Position pos) const {
+    return !VisitOwners(pos, [](Position) {
+        return false;
+    });
+}
+
+size_t RangeIndex::GetRangeCount() const {
+    return range_count_;
+}
+
+size_t RangeIndex::GetMemoryUsage() const {
+    // Узел красно-чёрного дерева: три ссылки, цвет и элемент
+    struct TreeNode {
+        void* links[3];
+        int color;
+        Entry entry;
+    };
+    size_t usage = GetHashTableMemoryUsage(row_nodes_) + range_count_ * 2 * sizeof(TreeNode);
+    for (const auto& [id, row_node] : row_nodes_) {
+        usage += GetHashTableMemoryUsage(row_node.col_nodes);
+    }
+    return usage;
+}
+
+int RangeIndex::GetLevel(int first, int last) {
+    int level = 0;
+    for (unsigned diff = static_cast<unsigned>(first ^ last); diff != 0; diff >>= 1) {
+        ++level;
+    }
+    return level;
+}
+
+int RangeIndex::GetNodeId(int level, int coord) {
+    return (coord >> level) * LEVELS + level;
+}
+
+bool RangeIndex::IsBeforeMiddle(int level, int coord) {
+    return level > 0 && !(coord >> (level - 1) & 1);
+}
+
+void PositionIndex::Add(Position pos) {
+    tiles_[TileGrid::GetTile(pos)].push_back(pos);
+}
+
+void PositionIndex::Remove(Position pos) {
+    auto it = tiles_.find(TileGrid::GetTile(pos));
+    assert(it != tiles_.end());
+    auto& positions = it->second;
+    auto pos_it = std::find(positions.begin(), positions.end(), pos);
+    assert(pos_it != positions.end());
+    *pos_it = positions.back();
+    positions.pop_back();
+    if (positions.empty()) {
+        tiles_.erase(it);
+    }
+}
+
+size_t PositionIndex::GetMemoryUsage() const {
+    size_t usage = GetHashTableMemoryUsage(tiles_);
+    for (const auto& [tile, positions] : tiles_) {
+        usage += positions.capacity() * sizeof(Position);
+    }
+    return usage;
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include "bit_utils.h"
+#include "common.h"
+
+#include <array>
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include <vector>
+
+// Разбивка таблицы на квадратные плитки TILE_SIZE x TILE_SIZE для
+// PositionIndex. Индекс хранит записи только в непустых плитках.
+class TileGrid {
+public:
+    static constexpr int TILE_SIZE = 64;
+    static constexpr int TILE_COLS = Position::MAX_COLS / TILE_SIZE;
+
+    static int GetTile(Position pos);
+    static size_t GetTileCount(CellRange range);
+
+    // Вызывает f(int tile) для каждой плитки, пересекающейся с диапазоном
+    template <typename F>
+    static void ForEachTile(CellRange range, F f);
+};
+
+// Индекс прямоугольных диапазонов, на которые ссылаются формулы. Каждый
+// диапазон хранится один раз - в двухуровневом центрированном дереве
+// интервалов над неявным двоичным деревом координат:
+// * дерево строк: диапазон попадает в узел, являющийся наименьшим общим
+//   предком его первой и последней строки, так что строки диапазона
+//   содержат середину узла;
+// * внутри узла строк - такое же дерево столбцов.
+// Все диапазоны одного узла содержат его центральную клетку, поэтому для
+// позиции по одну сторону от центра достаточно одностороннего условия по
+// строкам и по столбцам. Диапазоны узла упорядочены по первой строке и по
+// последней строке, и поиск перебирает только диапазоны, подходящие по
+// строкам, проверяя для каждого условие по столбцам.
+//
+// Поиск обходит не более LEVELS x LEVELS узлов (пустые уровни пропускаются)
+// и стоит O(LEVELS^2 + s), где s - число диапазонов этих узлов, подходящих
+// по строкам; s >= k, и лишними оказываются только диапазоны, которые
+// покрывают строку позиции, но не её столбец. Добавление и удаление стоят
+// O(log m), где m - число диапазонов узла.
+class RangeIndex {
+public:
+    void Add(CellRange range, Position owner);
+    // Удаляет ранее добавленную пару (range, owner)
+    void Remove(CellRange range, Position owner);
+
+    // Вызывает f(Position owner) для каждого диапазона, содержащего pos.
+    // Формула с несколькими такими диапазонами встретится несколько раз.
+    template <typename F>
+    void ForEachOwner(Position pos, F f) const;
+    bool IsCovered(Position pos) const;
+
+    size_t GetRangeCount() const;
+    size_t GetMemoryUsage() const;
+
+private:
+    // Число уровней дерева координат: от листьев (уровень 0) до корня
+    static constexpr int LEVELS = 15;
+    static_assert(Position::MAX_ROWS <= 1 << (LEVELS - 1) && Position::MAX_COLS <= 1 << (LEVELS - 1));
+
+    struct Entry {
+        CellRange range;
+        Position owner;
+    };
+    // Порядок по возрастанию первой строки и по убыванию последней; прочие
+    // поля только делают порядок полным
+    struct ByFirstRow {
+        bool operator()(const Entry& lhs, const Entry& rhs) const;
+    };
+    struct ByLastRow {
+        bool operator()(const Entry& lhs, const Entry& rhs) const;
+    };
+
+    struct Node {
+        std::multiset<Entry, ByFirstRow> by_first_row;
+        std::multiset<Entry, ByLastRow> by_last_row;
+    };
+    // Узел дерева строк с деревом столбцов внутри
+    struct RowNode {
+        std::unordered_map<int, Node> col_nodes;
+        // Число диапазонов на каждом уровне дерева столбцов и маска
+        // непустых уровней
+        std::array<size_t, LEVELS> col_level_counts{};
+        uint32_t col_levels = 0;
+    };
+
+    std::unordered_map<int, RowNode> row_nodes_;
+    std::array<size_t, LEVELS> row_level_counts_{};
+    uint32_t row_levels_ = 0;
+    size_t range_count_ = 0;
+
+    // Уровень наименьшего общего предка координат first <= last
+    static int GetLevel(int first, int last);
+    // Номер узла уровня level на пути к координате coord
+    static int GetNodeId(int level, int coord);
+    // Лежит ли coord левее середины узла уровня level на пути к ней. В листе
+    // все диапазоны ровно на этой координате, и годится любое из условий.
+    static bool IsBeforeMiddle(int level, int coord);
+
+    // Вызывает f(Position owner) для диапазонов, содержащих pos, пока f
+    // возвращает true. Возвращает false, если обход прерван.
+    template <typename F>
+    bool VisitOwners(Position pos, F f) const;
+};
+
+// Множество позиций с поиском всех позиций внутри диапазона
+class PositionIndex {
+public:
+    void Add(Position pos);
+    void Remove(Position pos);
+
+    // Вызывает f(Position) для каждой позиции множества внутри диапазона в
+    // произвольном порядке. Если f возвращает false, обход прекращается.
+    template <typename F>
+    void ForEachInRange(CellRange range, F f) const;
+
+    size_t GetMemoryUsage() const;
+
+private:
+    std::unordered_map<int, std::vector<Position>> tiles_;
+};
+
+template <typename F>
+void TileGrid::ForEachTile(CellRange range, F f) {
+    for (int row = range.first.row / TILE_SIZE; row <= range.last.row / TILE_SIZE; ++row) {
+        for (int col = range.first.col / TILE_SIZE; col <= range.last.col / TILE_SIZE; ++col) {
+            f(row * TILE_COLS + col);
+        }
+    }
+}
+
+template <typename F>
+void RangeIndex::ForEachOwner(Position pos, F f) const {
+    VisitOwners(pos, [&f](Position owner) {
+        f(owner);
+        return true;
+    });
+}
+
+template <typename F>
+bool RangeIndex::VisitOwners(Position pos, F f) const {
+    for (uint32_t row_levels = row_levels_; row_levels != 0; row_levels &= row_levels - 1) {
+        int row_level = GetLowestSetBit(row_levels);
+        auto row_it = row_nodes_.find(GetNodeId(row_level, pos.row));
+        if (row_it == row_nodes_.end()) {
+            continue;
+        }
+        const RowNode& row_node = row_it->second;
+        const bool before_row_middle = IsBeforeMiddle(row_level, pos.row);
+        for (uint32_t col_levels = row_node.col_levels; col_levels != 0; col_levels &= col_levels - 1) {
+            int col_level = GetLowestSetBit(col_levels);
+            auto it = row_node.col_nodes.find(GetNodeId(col_level, pos.col));
+            if (it == row_node.col_nodes.end()) {
+                continue;
+            }
+            const Node& node = it->second;
+            const bool before_col_middle = IsBeforeMiddle(col_level, pos.col);
+            auto visit = [&](const Entry& entry) {
+                bool col_matches = before_col_middle ? entry.range.first.col <= pos.col
+                                                     : entry.range.last.col >= pos.col;
+                return !col_matches || f(entry.owner);
+            };
+            if (before_row_middle) {
+                for (const Entry& entry : node.by_first_row) {
+                    if (entry.range.first.row > pos.row) {
+                        break;
+                    }
+                    if (!visit(entry)) {
+                        return false;
+                    }
+                }
+            }
+            else {
+                for (const Entry& entry : node.by_last_row) {
+                    if (entry.range.last.row < pos.row) {
+                        break;
+                    }
+                    if (!visit(entry)) {
+                        return false;
+                    }
+                }
+            }
+        }
+    }
+    return true;
+}
+
+template <typename F>
+void PositionIndex::ForEachInRange(CellRange range, F f) const {
+    auto visit = [&range, &f](const std::vector<Position>& positions) {
+        for (const Position& pos : positions) {
+            if (range.Contains(pos) && !f(pos)) {
+                return false;
+            }
+        }
+        return true;
+    };
+    // Огромный диапазон задевает больше плиток, чем занято во всём индексе
+    if (TileGrid::GetTileCount(range) > tiles_.size()) {
+        for (const auto& [tile, positions] : tiles_) {
+            if (!visit(positions)) {
+                return;
+            }
+        }
+        return;
+    }
+    bool proceed = true;
+    TileGrid::ForEachTile(range, [&](int tile) {
+        if (!proceed) {
+            return;
+        }
+        if (auto it = tiles_.find(tile); it != tiles_.end()) {
+            proceed = visit(it->second);
+        }
+    });
+}
@@ -0,0 +1,17 @@
+#include "stats_counters.h"
+
+uint64_t StatsCounters::Get(Counter counter) const {
+    uint64_t sum = 0;
+    for (const Stripe& stripe : stripes_) {
+        sum += stripe.values[counter].load(std::memory_order_relaxed);
+    }
+    return sum;
+}
+
+void StatsCounters::Reset() {
+    for (Stripe& stripe : stripes_) {
+        for (std::atomic<uint64_t>& value : stripe.values) {
+            value.store(0, std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Счётчики событий таблицы для SheetInterface::GetStats(). Рассчитаны на
+// горячие пути, в том числе на параллельный пересчёт: каждый поток пишет в
+// свою полосу, занимающую отдельную строку кэша, relaxed-чтением и записью,
+// без атомарных операций чтения-изменения-записи. Если потоков больше, чем
+// полос, несколько потоков делят одну полосу, и их одновременные увеличения
+// изредка теряются - для статистики это допустимо.
+class StatsCounters {
+public:
+    enum Counter {
+        FormulaEvaluations,
+        CacheHits,
+        Invalidations,
+        InvalidatedCells,
+        FormulasParsed,
+        ParseNanoseconds,
+        COUNTER_COUNT
+    };
+
+    void Add(Counter counter, uint64_t value = 1) {
+        std::atomic<uint64_t>& target = stripes_[GetStripe()].values[counter];
+        target.store(target.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+    }
+
+    // Сумма по всем полосам
+    uint64_t Get(Counter counter) const;
+    void Reset();
+
+private:
+    static constexpr size_t STRIPE_COUNT = 16;
+    static constexpr size_t NO_STRIPE = SIZE_MAX;
+
+    struct alignas(64) Stripe {
+        std::array<std::atomic<uint64_t>, COUNTER_COUNT> values{};
+    };
+    std::array<Stripe, STRIPE_COUNT> stripes_{};
+
+    // Полосы раздаются потокам по кругу при первом увеличении счётчика
+    static inline std::atomic<size_t> next_stripe_{0};
+    static inline thread_local size_t thread_stripe_ = NO_STRIPE;
+
+    static size_t GetStripe() {
+        if (thread_stripe_ == NO_STRIPE) {
+            thread_stripe_ = next_stripe_.fetch_add(1, std::memory_order_relaxed) % STRIPE_COUNT;
+        }
+        return thread_stripe_;
+    }
+};
@@ -1,98 +1,19 @@
 #include "common.h"
 
-#include <cctype>
-#include <sstream>
-#include <algorithm>
-
-const int LETTERS = 26;
-const int MAX_POSITION_LENGTH = 17;
-const int MAX_POS_LETTER_COUNT = 3;
-
-namespace {
-    using namespace std::literals;
-    const std::string uppercase_alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZ"s;
-    const std::string digits = "0123456789"s;
-    bool IsValidSV(std::string_view cell_sv) {
-        bool contains_only_admissible_symbols = cell_sv.find_first_not_of(uppercase_alphabet + digits) == cell_sv.npos;
-        bool contains_uppercase_letters = cell_sv.find_first_not_of(uppercase_alphabet) != cell_sv.npos;
-        bool contains_digits = cell_sv.find_first_not_of(digits) != cell_sv.npos;
-        bool letters_first = cell_sv.find_last_of(uppercase_alphabet) < cell_sv.find_first_of(digits);
-
-        return 
-            contains_only_admissible_symbols &&
-            contains_uppercase_letters &&
-            contains_digits &&
-            letters_first;
-	}
-
-    std::string_view GetRowSV(std::string_view cell_sv) {
-		return cell_sv.substr(cell_sv.find_first_of(digits));
-	}
-
-	std::string_view GetColSV(std::string_view cell_sv) {
-		return cell_sv.substr(0, cell_sv.find_first_of(digits));
-	}
-}
-
-const Position Position::NONE = {-1, -1};
-
-bool Position::operator==(const Position rhs) const {
-    return row == rhs.row && col == rhs.col;
-}
-
-bool Position::operator<(const Position rhs) const {
-    return std::tie(row, col) < std::tie(rhs.row, rhs.col);
-}
-
-bool Position::IsValid() const {
-    return row >= 0 && col >= 0 && row < MAX_ROWS && col < MAX_COLS;
-}
+#include <charconv>
+#include <cmath>
 
 std::string Position::ToString() const {
-    if (!IsValid()) {
-        return "";
-    }
-
-    std::string result;
-    result.reserve(MAX_POSITION_LENGTH);
-    int c = col;
-    while (c >= 0) {
-        result.insert(result.begin(), 'A' + c % LETTERS);
-        c = c / LETTERS - 1;
-    }
-
-    result += std::to_string(row + 1);
-
-    return result;
+    char buffer[MAX_STRING_LENGTH];
+    return std::string(buffer, ToChars(buffer));
 }
 
-Position Position::FromString(std::string_view str) {
-    if (!IsValidSV(str)) {
-        return Position::NONE;
-    }
-
-    auto letters = GetColSV(str);
-    auto digits = GetRowSV(str);
-
-    int col = 0;
-    for (char ch : letters) {
-        col *= LETTERS;
-        col += ch - 'A' + 1;
-    }
-    
-    int row; 
-    try {
-        row = std::stoi(std::string(digits));
-    }
-    catch (...) {
-        return Position::NONE;
-    }
+bool CellRange::operator==(CellRange rhs) const {
+    return first == rhs.first && last == rhs.last;
+}
 
-    Position result = {row - 1, col - 1};
-    if (!result.IsValid()) {
-        return Position::NONE;
-    }
-    return result;
+bool CellRange::Contains(Position pos) const {
+    return first.row <= pos.row && pos.row <= last.row && first.col <= pos.col && pos.col <= last.col;
 }
 
 bool Size::operator==(Size rhs) const {
@@ -121,4 +42,58 @@ std::string_view FormulaError::ToString() const {
     else {
         return "#DIV/0!";
     }
-}
\ No newline at end of file
+}
+
+std::optional<double> ParseNumericText(std::string_view text) {
+    double result = 0;
+    const char* end = text.data() + text.size();
+    auto [ptr, error] = std::from_chars(text.data(), end, result);
+    if (error != std::errc() || ptr != end || !std::isfinite(result)) {
+        return std::nullopt;
+    }
+    return result;
+}
+
+CellInterface::NumericValue CellInterface::GetNumericValue() const {
+    Value value = GetValue();
+    if (const double* number = std::get_if<double>(&value)) {
+        return *number;
+    }
+    if (const std::string* text = std::get_if<std::string>(&value)) {
+        if (text->empty()) {
+            return 0.0;
+        }
+        if (auto number = ParseNumericText(*text)) {
+            return *number;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    }
+    return std::get<FormulaError>(value);
+}
+
+std::vector<CellRange> CellInterface::GetReferencedRanges() const {
+    return {};
+}
+
+std::optional<FormulaError> SheetInterface::CollectRangeNumbers(CellRange range,
+                                                                std::vector<double>& numbers) const {
+    for (int row = range.first.row; row <= range.last.row; ++row) {
+        for (int col = range.first.col; col <= range.last.col; ++col) {
+            const CellInterface* cell = GetCell(Position{row, col});
+            if (!cell) {
+                continue;
+            }
+            CellInterface::Value value = cell->GetValue();
+            if (const double* number = std::get_if<double>(&value)) {
+                numbers.push_back(*number);
+            } else if (const std::string* text = std::get_if<std::string>(&value)) {
+                if (auto number = ParseNumericText(*text)) {
+                    numbers.push_back(*number);
+                }
+            } else {
+                return std::get<FormulaError>(value);
+            }
+        }
+    }
+    return std::nullopt;
+}
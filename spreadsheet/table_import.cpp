@@ -0,0 +1,154 @@
+#include "sheet.h"
+
+#include <algorithm>
+#include <istream>
+#include <string>
+#include <string_view>
+
+using namespace std::literals;
+
+namespace {
+// Вход читается блоками такого размера, а не построчно
+constexpr size_t READ_CHUNK_SIZE = 64 * 1024;
+// Граф строится заново, если новых рёбер не меньше 1/BULK_EDGE_RATIO от
+// уже имеющихся
+constexpr size_t BULK_EDGE_RATIO = 4;
+
+// Разбирает текстовую таблицу из потока и вызывает on_field(Position,
+// std::string) для каждого поля по порядку строк и столбцов. Поле может
+// пересекать границу блоков. Разбор снисходителен к ошибкам: кавычка внутри
+// поля без кавычек и текст после закрывающей кавычки попадают в поле как
+// есть, а незакрытая кавычка продолжает поле до конца входа. Перевод строки
+// "\r\n" равнозначен "\n".
+template <typename OnField>
+void ReadTable(std::istream& input, TableFormat format, OnField on_field) {
+    const bool quoting = format == TableFormat::Csv;
+    const char delimiter = quoting ? ',' : '\t';
+    const char stops[] = {delimiter, '\n'};
+
+    enum class State {
+        FieldStart,
+        Unquoted,
+        Quoted,
+        // Кавычка внутри поля в кавычках: либо конец поля, либо первая
+        // половина удвоенной кавычки
+        QuoteInQuoted,
+    };
+    State state = State::FieldStart;
+    std::string field;
+    // Длина поля в момент закрывающей кавычки: "\r" перед ней - часть поля
+    size_t quoted_size = 0;
+    Position pos{0, 0};
+
+    auto end_field = [&]() {
+        on_field(pos, std::move(field));
+        field.clear();
+        quoted_size = 0;
+        state = State::FieldStart;
+    };
+    auto end_record = [&]() {
+        if (field.size() > quoted_size && field.back() == '\r') {
+            field.pop_back();
+        }
+        end_field();
+        ++pos.row;
+        pos.col = 0;
+    };
+
+    std::string buffer(READ_CHUNK_SIZE, '\0');
+    while (input) {
+        input.read(buffer.data(), buffer.size());
+        std::string_view chunk(buffer.data(), input.gcount());
+        size_t i = 0;
+        while (i < chunk.size()) {
+            if (state == State::Quoted) {
+                size_t quote = chunk.find('"', i);
+                if (quote == chunk.npos) {
+                    field.append(chunk.substr(i));
+                    break;
+                }
+                field.append(chunk.substr(i, quote - i));
+                state = State::QuoteInQuoted;
+                i = quote + 1;
+                continue;
+            }
+            char c = chunk[i];
+            if (state == State::QuoteInQuoted) {
+                if (c == '"') {
+                    field += '"';
+                    state = State::Quoted;
+                    ++i;
+                    continue;
+                }
+                quoted_size = field.size();
+                state = State::Unquoted;
+            }
+            if (c == delimiter) {
+                end_field();
+                ++pos.col;
+                ++i;
+            }
+            else if (c == '\n') {
+                end_record();
+                ++i;
+            }
+            else if (c == '"' && quoting && state == State::FieldStart) {
+                state = State::Quoted;
+                ++i;
+            }
+            else {
+                size_t stop = std::min(chunk.find_first_of(std::string_view(stops, 2), i), chunk.size());
+                field.append(chunk.substr(i, stop - i));
+                state = State::Unquoted;
+                i = stop;
+            }
+        }
+    }
+    if (input.bad()) {
+        throw std::ios_base::failure("Failed to read table"s);
+    }
+    // Последняя строка без перевода строки
+    if (state != State::FieldStart || pos.col > 0) {
+        end_record();
+    }
+}
+}
+
+void Sheet::ImportTable(std::istream& input, TableFormat format) {
+    // Поля разбираются по мере чтения; таблица не меняется, пока не прочитан
+    // весь вход, так что синтаксическая ошибка или ошибка чтения ничего не
+    // откатывают
+    std::vector<std::pair<Position, Cell>> new_cells;
+    ReadTable(input, format, [&](Position pos, std::string text) {
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("Invalid position"s);
+        }
+        // Пустое поле меняет только уже существующую ячейку
+        if (text.empty() && !cells_.Find(pos)) {
+            return;
+        }
+        auto& [cell_pos, cell] = new_cells.emplace_back();
+        cell_pos = pos;
+        cell.Set(std::move(text), pos, &cell_context_);
+    });
+
+    if (new_cells.empty()) {
+        return;
+    }
+    // Перестройка порядка обходит весь граф, поэтому она выгоднее поштучного
+    // добавления рёбер, только если вход сравним по размеру с графом
+    size_t new_edge_count = 0;
+    for (const auto& [pos, cell] : new_cells) {
+        new_edge_count += cell.GetReferencedCells().size() + cell.GetReferencedRanges().size();
+    }
+    const bool bulk = new_edge_count > 0 && new_edge_count * BULK_EDGE_RATIO >= graph_.GetEdgeCount();
+    ProcessCellSetting(new_cells, bulk);
+
+    std::vector<Position> changed;
+    changed.reserve(new_cells.size());
+    for (const auto& [pos, cell] : new_cells) {
+        changed.push_back(pos);
+    }
+    InvalidateCache(changed);
+    ApplyCalculationPolicy();
+}
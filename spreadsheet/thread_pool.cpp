@@ -0,0 +1,137 @@
+#include "thread_pool.h"
+
+WorkStealingPool::Context::Context(WorkStealingPool& pool, size_t worker)
+    : pool_(pool)
+    , worker_(worker)
+{}
+
+void WorkStealingPool::Context::Spawn(size_t task) {
+    Queue& queue = *pool_.queues_[worker_];
+    std::lock_guard lock(queue.mutex);
+    queue.tasks.push_back(task);
+}
+
+WorkStealingPool::WorkStealingPool(size_t thread_count) {
+    if (thread_count == 0) {
+        thread_count = 1;
+    }
+    for (size_t i = 0; i < thread_count; ++i) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    // Поток с номером 0 - это поток, вызывающий Run()
+    for (size_t worker = 1; worker < thread_count; ++worker) {
+        threads_.emplace_back([this, worker] { WorkerLoop(worker); });
+    }
+}
+
+WorkStealingPool::~WorkStealingPool() {
+    {
+        std::lock_guard lock(run_mutex_);
+        stopping_ = true;
+    }
+    run_started_.notify_all();
+    for (auto& thread : threads_) {
+        thread.join();
+    }
+}
+
+size_t WorkStealingPool::GetThreadCount() const {
+    return queues_.size();
+}
+
+void WorkStealingPool::Run(const std::vector<size_t>& initial_tasks, size_t task_count, const Handler& handler) {
+    if (task_count == 0) {
+        return;
+    }
+    for (size_t i = 0; i < initial_tasks.size(); ++i) {
+        queues_[i % queues_.size()]->tasks.push_back(initial_tasks[i]);
+    }
+    handler_ = &handler;
+    remaining_tasks_ = task_count;
+    aborted_ = false;
+    error_ = nullptr;
+    {
+        std::lock_guard lock(run_mutex_);
+        ++generation_;
+        active_workers_ = threads_.size();
+    }
+    run_started_.notify_all();
+
+    ProcessTasks(0);
+
+    std::unique_lock lock(run_mutex_);
+    run_finished_.wait(lock, [this] { return active_workers_ == 0; });
+    handler_ = nullptr;
+    for (auto& queue : queues_) {
+        queue->tasks.clear();
+    }
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+void WorkStealingPool::WorkerLoop(size_t worker) {
+    size_t seen_generation = 0;
+    while (true) {
+        {
+            std::unique_lock lock(run_mutex_);
+            run_started_.wait(lock, [&] { return stopping_ || generation_ != seen_generation; });
+            if (stopping_) {
+                return;
+            }
+            seen_generation = generation_;
+        }
+
+        ProcessTasks(worker);
+
+        {
+            std::lock_guard lock(run_mutex_);
+            --active_workers_;
+        }
+        run_finished_.notify_all();
+    }
+}
+
+void WorkStealingPool::ProcessTasks(size_t worker) {
+    Context context(*this, worker);
+    while (remaining_tasks_.load(std::memory_order_acquire) > 0 && !aborted_.load(std::memory_order_relaxed)) {
+        size_t task;
+        if (!TryPop(worker, task)) {
+            std::this_thread::yield();
+            continue;
+        }
+        try {
+            (*handler_)(task, context);
+        }
+        catch (...) {
+            std::lock_guard lock(run_mutex_);
+            if (!error_) {
+                error_ = std::current_exception();
+            }
+            aborted_ = true;
+        }
+        remaining_tasks_.fetch_sub(1, std::memory_order_acq_rel);
+    }
+}
+
+bool WorkStealingPool::TryPop(size_t worker, size_t& task) {
+    {
+        Queue& own = *queues_[worker];
+        std::lock_guard lock(own.mutex);
+        if (!own.tasks.empty()) {
+            task = own.tasks.back();
+            own.tasks.pop_back();
+            return true;
+        }
+    }
+    for (size_t i = 1; i < queues_.size(); ++i) {
+        Queue& victim = *queues_[(worker + i) % queues_.size()];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+            task = victim.tasks.front();
+            victim.tasks.pop_front();
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул потоков с перехватом работы (work stealing) для обхода графа задач.
+// Задачи - это индексы, а обработчик задачи может порождать новые задачи,
+// например, когда у вершины графа зависимостей готовы все входы. Каждый
+// поток берёт задачи из конца своей очереди, а освободившись, забирает
+// задачи из начала очередей других потоков.
+class WorkStealingPool {
+public:
+    class Context {
+    public:
+        // Добавляет задачу в очередь текущего потока
+        void Spawn(size_t task);
+
+    private:
+        friend class WorkStealingPool;
+        Context(WorkStealingPool& pool, size_t worker);
+
+        WorkStealingPool& pool_;
+        size_t worker_;
+    };
+
+    using Handler = std::function<void(size_t task, Context& context)>;
+
+    // thread_count - общее число потоков, включая поток, вызывающий Run()
+    explicit WorkStealingPool(size_t thread_count);
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+    ~WorkStealingPool();
+
+    size_t GetThreadCount() const;
+
+    // Выполняет task_count задач: сначала initial_tasks, затем порождённые
+    // обработчиками. Возвращает управление, когда выполнены все задачи.
+    // Если обработчик бросил исключение, оставшиеся задачи отменяются, а
+    // исключение пробрасывается вызывающему.
+    void Run(const std::vector<size_t>& initial_tasks, size_t task_count, const Handler& handler);
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+
+    std::mutex run_mutex_;
+    std::condition_variable run_started_;
+    std::condition_variable run_finished_;
+    // Номер текущего запуска Run(); потоки ждут его изменения
+    size_t generation_ = 0;
+    size_t active_workers_ = 0;
+    bool stopping_ = false;
+
+    const Handler* handler_ = nullptr;
+    std::atomic<size_t> remaining_tasks_ = 0;
+    std::atomic<bool> aborted_ = false;
+    std::exception_ptr error_;
+
+    void WorkerLoop(size_t worker);
+    void ProcessTasks(size_t worker);
+    bool TryPop(size_t worker, size_t& task);
+};